@@ -0,0 +1,120 @@
+/* See LICENSE file for copyright and license details. */
+/*
+ * time the slot scans of a connection table with nslots slots (-s),
+ * spread across naddr in-addresses (default nslots / 8):
+ *
+ *  - fill:      taking a vacant slot and counting it in, per slot
+ *  - candidate: selecting the connection to drop from the full table
+ *  - walk:      a pass over all struct connection slots looking at the
+ *               fields the selection needs, as a scan of the whole
+ *               table did before they were kept apart
+ *
+ * The table is built from the static functions of connection.c,
+ * which is why it is included rather than linked. Nothing is
+ * accepted, so no fd or event queue is needed.
+ *
+ * "make benchmark" runs it for growing tables, with eight connections
+ * per in-address and with all connections from only 16 of them
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../connection.c"
+
+#define ROUNDS 64
+
+static double
+elapsed(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1e9 + (b->tv_nsec - a->tv_nsec);
+}
+
+static size_t
+walk(struct connection_chunk **chunk, size_t nchunks)
+{
+	size_t i, j, n = 0;
+
+	for (i = 0; i < nchunks; i++) {
+		for (j = 0; j < chunk[i]->nslots; j++) {
+			n += chunk[i]->slot[j].state +
+			     chunk[i]->slot[j].progress +
+			     chunk[i]->slot[j].ia.ss_family;
+		}
+	}
+
+	return n;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct connection_budget budget;
+	struct connection_chunk **chunk;
+	struct connection_pools pools = { 0 };
+	struct connection_table t;
+	struct connection *c;
+	struct sockaddr_in6 *sa;
+	struct timespec a, b;
+	volatile size_t sink = 0;
+	size_t i, r, nslots, naddr, nchunks = 0;
+	double fill, cand, scan;
+
+	if (argc < 2 || !(nslots = strtoul(argv[1], NULL, 10))) {
+		die("usage: %s nslots [naddr]", argv[0]);
+	}
+	naddr = (argc > 2) ? strtoul(argv[2], NULL, 10) : nslots / 8;
+	naddr = MAX(naddr, 1);
+
+	if (!(pools.peer = pool_create(sizeof(struct connection_peer),
+	                               naddr)) ||
+	    connection_budget_init(&budget, 1, nslots) ||
+	    connection_table_init(&t, nslots, &budget, NULL) ||
+	    !(chunk = calloc(nslots, sizeof(*chunk)))) {
+		return 1;
+	}
+
+	/* occupy all slots, in sending states with scattered progress */
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	for (i = 0; i < nslots; i++) {
+		c = connection_get_vacant(&t);
+		c->pools = &pools;
+		sa = (struct sockaddr_in6 *)&c->ia;
+		sa->sin6_family = AF_INET6;
+		sa->sin6_addr.s6_addr[0] = 0x20;
+		sa->sin6_addr.s6_addr[13] = (i % naddr) >> 16;
+		sa->sin6_addr.s6_addr[14] = (i % naddr) >> 8;
+		sa->sin6_addr.s6_addr[15] = i % naddr;
+		c->state = C_SEND_HEADER + i % 2;
+		c->progress = i * 7919 % 100000;
+		if (connection_occupy(c)) {
+			return 1;
+		}
+		/* full chunks are not listed, note them for walk() */
+		if (nchunks == 0 || chunk[nchunks - 1] != c->chunk) {
+			chunk[nchunks++] = c->chunk;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &b);
+	fill = elapsed(&a, &b) / nslots;
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	for (r = 0; r < ROUNDS; r++) {
+		sink += (size_t)connection_get_drop_candidate(&t);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &b);
+	cand = elapsed(&a, &b) / ROUNDS;
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	for (r = 0; r < ROUNDS; r++) {
+		sink += walk(chunk, nchunks);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &b);
+	scan = elapsed(&a, &b) / ROUNDS;
+
+	printf("%8zu slots %7zu addresses: fill %6.1f ns/slot, "
+	       "candidate %9.1f ns, walk %11.1f ns\n", nslots, naddr,
+	       fill, cand, scan);
+
+	return sink == 0;
+}
@@ -0,0 +1,556 @@
+/* See LICENSE file for copyright and license details. */
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef __linux__
+	#include <linux/memfd.h>
+	#include <sys/syscall.h>
+#endif
+
+#include "cache.h"
+#include "config.h"
+#include "util.h"
+
+/*
+ * in-memory cache of small, frequently requested files shared by all
+ * worker threads.
+ *
+ * The cached bytes live in a single memfd-backed arena of the
+ * configured size, which is mapped for direct access and can also be
+ * handed to sendfile(). Each entry occupies a contiguous extent of
+ * the arena; free extents are kept in a list sorted by offset and
+ * merged on release.
+ *
+ * Entries are kept in LRU-order, but a new file is only admitted at
+ * the expense of the least recently used entries if it has been
+ * requested more often than them (TinyLFU). The request frequencies
+ * are estimated with a count-min sketch of 4-bit counters, which are
+ * halved periodically so the estimate follows recent popularity. This
+ * way, a single sweep over many rarely requested files (e.g. by a
+ * crawler) can not flush the working set.
+ *
+ * Besides files, the cache holds generated content like directory
+ * listings under a key of the caller's choice, tied to the stat of
+ * the file it was generated from.
+ */
+struct cache_entry {
+	struct cache_entry *next;
+	struct cache_entry *lprev, *lnext;
+	char *key;
+	uint32_t hash;
+	struct stat st;
+	size_t off;
+	size_t len;
+	size_t refcount;
+	int stale;
+};
+
+struct extent {
+	size_t off;
+	size_t len;
+	struct extent *next;
+};
+
+static int arenafd = -1;
+static char *arena;
+static size_t arenasize;
+static struct extent *freelist;
+static struct cache_entry **bucket;
+static size_t nbuckets;
+static struct cache_entry *lhead, *ltail;
+static uint8_t *sketch;
+static size_t sketchbits, nsamples;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const uint32_t seed[] = {
+	0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f,
+};
+
+static uint8_t *
+sketch_counter(uint32_t h, size_t row)
+{
+	return &sketch[(row << sketchbits) +
+	               ((uint32_t)(h * seed[row]) >> (32 - sketchbits))];
+}
+
+static void
+sketch_increment(uint32_t h)
+{
+	size_t i;
+
+	for (i = 0; i < LEN(seed); i++) {
+		if (*sketch_counter(h, i) < 15) {
+			(*sketch_counter(h, i))++;
+		}
+	}
+
+	/* age all counters after a sample of 10 times the width */
+	if (++nsamples == ((size_t)10 << sketchbits)) {
+		for (i = 0; i < (LEN(seed) << sketchbits); i++) {
+			sketch[i] >>= 1;
+		}
+		nsamples /= 2;
+	}
+}
+
+static unsigned int
+sketch_estimate(uint32_t h)
+{
+	size_t i;
+	unsigned int min;
+
+	for (i = 0, min = 15; i < LEN(seed); i++) {
+		min = MIN(min, *sketch_counter(h, i));
+	}
+
+	return min;
+}
+
+static int
+extent_alloc(size_t len, size_t *off)
+{
+	struct extent **p, *e;
+
+	/* first fit */
+	for (p = &freelist; *p != NULL; p = &(*p)->next) {
+		if ((*p)->len < len) {
+			continue;
+		}
+		*off = (*p)->off;
+		if ((*p)->len == len) {
+			e = *p;
+			*p = e->next;
+			free(e);
+		} else {
+			(*p)->off += len;
+			(*p)->len -= len;
+		}
+
+		return 0;
+	}
+
+	return 1;
+}
+
+static void
+extent_free(size_t off, size_t len)
+{
+	struct extent **p, *prev, *e;
+
+	for (p = &freelist, prev = NULL; *p != NULL && (*p)->off < off;
+	     prev = *p, p = &(*p)->next)
+		;
+
+	if (prev != NULL && prev->off + prev->len == off) {
+		/* merge with predecessor and possibly successor */
+		prev->len += len;
+		if ((e = prev->next) != NULL &&
+		    prev->off + prev->len == e->off) {
+			prev->len += e->len;
+			prev->next = e->next;
+			free(e);
+		}
+	} else if (*p != NULL && off + len == (*p)->off) {
+		/* merge with successor */
+		(*p)->off = off;
+		(*p)->len += len;
+	} else {
+		if (!(e = malloc(sizeof(*e)))) {
+			die("malloc:");
+		}
+		e->off = off;
+		e->len = len;
+		e->next = *p;
+		*p = e;
+	}
+}
+
+static void
+lru_unlink(struct cache_entry *e)
+{
+	if (e->lprev != NULL) {
+		e->lprev->lnext = e->lnext;
+	} else {
+		lhead = e->lnext;
+	}
+	if (e->lnext != NULL) {
+		e->lnext->lprev = e->lprev;
+	} else {
+		ltail = e->lprev;
+	}
+	e->lprev = e->lnext = NULL;
+}
+
+static void
+lru_push(struct cache_entry *e)
+{
+	e->lprev = NULL;
+	e->lnext = lhead;
+	if (lhead != NULL) {
+		lhead->lprev = e;
+	} else {
+		ltail = e;
+	}
+	lhead = e;
+}
+
+static void
+entry_insert(struct cache_entry *e)
+{
+	struct cache_entry **b = &bucket[e->hash & (nbuckets - 1)];
+
+	e->next = *b;
+	*b = e;
+	lru_push(e);
+}
+
+static void
+entry_remove(struct cache_entry *e)
+{
+	struct cache_entry **p;
+
+	/* make the entry invisible, it is freed once unreferenced */
+	for (p = &bucket[e->hash & (nbuckets - 1)]; *p != NULL;
+	     p = &(*p)->next) {
+		if (*p == e) {
+			*p = e->next;
+			break;
+		}
+	}
+	lru_unlink(e);
+	e->stale = 1;
+}
+
+static void
+entry_free(struct cache_entry *e)
+{
+	extent_free(e->off, e->len);
+	free(e->key);
+	free(e);
+}
+
+void
+cache_init(size_t size)
+{
+	if (size == 0) {
+		return;
+	}
+
+	#ifdef __linux__
+		/* create and map the arena */
+		if ((arenafd = syscall(SYS_memfd_create, "quark-cache",
+		                       MFD_CLOEXEC)) < 0) {
+			die("memfd_create:");
+		}
+		if (ftruncate(arenafd, size) < 0) {
+			die("ftruncate:");
+		}
+		if ((arena = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		                  MAP_SHARED, arenafd, 0)) == MAP_FAILED) {
+			die("mmap:");
+		}
+		if (!(freelist = malloc(sizeof(*freelist)))) {
+			die("malloc:");
+		}
+		freelist->off = 0;
+		freelist->len = size;
+		freelist->next = NULL;
+
+		/* about one bucket per page-sized file */
+		for (nbuckets = 64; nbuckets < size / 4096; nbuckets *= 2)
+			;
+		if (!(bucket = calloc(nbuckets, sizeof(*bucket)))) {
+			die("calloc:");
+		}
+
+		/* sketch rows are 4 times as wide as there are buckets */
+		for (sketchbits = 0; ((size_t)1 << sketchbits) < 4 * nbuckets;
+		     sketchbits++)
+			;
+		if (!(sketch = calloc(LEN(seed) << sketchbits,
+		                      sizeof(*sketch)))) {
+			die("calloc:");
+		}
+
+		arenasize = size;
+	#else
+		warn("The content cache requires memfd_create(), "
+		     "disabling it");
+	#endif
+}
+
+static struct cache_entry *
+lookup(const char *key, uint32_t h, const struct stat *st)
+{
+	struct cache_entry *e;
+
+	for (e = bucket[h & (nbuckets - 1)]; e != NULL; e = e->next) {
+		if (e->hash != h || strcmp(e->key, key)) {
+			continue;
+		}
+		if (same_file(&e->st, st)) {
+			e->refcount++;
+			lru_unlink(e);
+			lru_push(e);
+			return e;
+		}
+
+		/* the file has changed since it was cached */
+		entry_remove(e);
+		if (e->refcount == 0) {
+			entry_free(e);
+		}
+		break;
+	}
+
+	return NULL;
+}
+
+static struct cache_entry *
+admit(const char *key, uint32_t h, size_t len)
+{
+	struct cache_entry *e, *victim;
+	unsigned int freq;
+
+	/*
+	 * make room by evicting the least recently used unreferenced
+	 * entries, but only as long as they are requested less often
+	 * than the candidate
+	 */
+	freq = sketch_estimate(h);
+	if (!(e = calloc(1, sizeof(*e))) || !(e->key = strdup(key))) {
+		free(e);
+		return NULL;
+	}
+	while (extent_alloc(len, &e->off)) {
+		for (victim = ltail; victim != NULL && victim->refcount > 0;
+		     victim = victim->lprev)
+			;
+		if (victim == NULL || sketch_estimate(victim->hash) >= freq) {
+			free(e->key);
+			free(e);
+			return NULL;
+		}
+		entry_remove(victim);
+		entry_free(victim);
+	}
+	e->hash = h;
+	e->len = len;
+	e->refcount = 1;
+
+	return e;
+}
+
+static void
+publish(struct cache_entry *e)
+{
+	struct cache_entry *old;
+
+	/* replace an entry someone else has filled meanwhile */
+	for (old = bucket[e->hash & (nbuckets - 1)]; old != NULL;
+	     old = old->next) {
+		if (old->hash == e->hash && !strcmp(old->key, e->key)) {
+			entry_remove(old);
+			if (old->refcount == 0) {
+				entry_free(old);
+			}
+			break;
+		}
+	}
+	entry_insert(e);
+}
+
+struct cache_entry *
+cache_open(const char *path, const struct stat *st, int *fd, size_t *off)
+{
+	struct cache_entry *e;
+	struct stat fst;
+	ssize_t r;
+	size_t len, done;
+	uint32_t h;
+	int filefd;
+
+	if (arenasize == 0) {
+		return NULL;
+	}
+	h = strhash(path);
+
+	/* look for the cached file */
+	pthread_mutex_lock(&lock);
+	sketch_increment(h);
+	if ((e = lookup(path, h, st))) {
+		pthread_mutex_unlock(&lock);
+
+		*fd = arenafd;
+		*off = e->off;
+		return e;
+	}
+
+	/* only consider small regular files */
+	len = st->st_size;
+	if (!S_ISREG(st->st_mode) || len == 0 || len > CACHE_FILE_MAX ||
+	    len > arenasize || !(e = admit(path, h, len))) {
+		pthread_mutex_unlock(&lock);
+		return NULL;
+	}
+	pthread_mutex_unlock(&lock);
+
+	/*
+	 * fill the extent without holding the lock; the entry is not
+	 * visible to anyone else yet
+	 */
+	if ((filefd = open(path, O_RDONLY)) < 0) {
+		goto err;
+	}
+	if (fstat(filefd, &fst) < 0 || !same_file(&fst, st)) {
+		/* the file has been replaced meanwhile */
+		close(filefd);
+		goto err;
+	}
+	for (done = 0; done < len; done += r) {
+		if ((r = pread(filefd, arena + e->off + done, len - done,
+		               done)) <= 0) {
+			close(filefd);
+			goto err;
+		}
+	}
+	close(filefd);
+	e->st = fst;
+
+	pthread_mutex_lock(&lock);
+	publish(e);
+	pthread_mutex_unlock(&lock);
+
+	*fd = arenafd;
+	*off = e->off;
+	return e;
+err:
+	pthread_mutex_lock(&lock);
+	entry_free(e);
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+struct cache_entry *
+cache_get(const char *key, const struct stat *st, int *fd, size_t *off,
+          size_t *len)
+{
+	struct cache_entry *e;
+	uint32_t h;
+
+	/*
+	 * look for generated content (e.g. a directory listing), which
+	 * is valid as long as the file st belongs to is unchanged
+	 */
+	if (arenasize == 0) {
+		return NULL;
+	}
+	h = strhash(key);
+
+	pthread_mutex_lock(&lock);
+	sketch_increment(h);
+	e = lookup(key, h, st);
+	pthread_mutex_unlock(&lock);
+
+	if (e != NULL) {
+		*fd = arenafd;
+		*off = e->off;
+		*len = e->len;
+	}
+
+	return e;
+}
+
+struct cache_entry *
+cache_reserve(const char *key, size_t len, char **data)
+{
+	struct cache_entry *e;
+
+	/*
+	 * make room for up to len bytes of generated content, if it
+	 * is requested often enough, before it is generated. The
+	 * request has already been counted by cache_get()
+	 */
+	if (arenasize == 0 || len == 0 || len > CACHE_LISTING_MAX ||
+	    len > arenasize) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&lock);
+	e = admit(key, strhash(key), len);
+	pthread_mutex_unlock(&lock);
+	if (e == NULL) {
+		return NULL;
+	}
+
+	/* it is not visible to anyone else until committed */
+	*data = arena + e->off;
+	return e;
+}
+
+void
+cache_commit(struct cache_entry *e, const struct stat *st, size_t len,
+             int *fd, size_t *off)
+{
+	/* publish the first len bytes of the room, give back the rest */
+	pthread_mutex_lock(&lock);
+	if (len < e->len) {
+		extent_free(e->off + len, e->len - len);
+		e->len = len;
+	}
+	e->st = *st;
+	publish(e);
+	pthread_mutex_unlock(&lock);
+
+	*fd = arenafd;
+	*off = e->off;
+}
+
+void
+cache_abandon(struct cache_entry *e)
+{
+	pthread_mutex_lock(&lock);
+	entry_free(e);
+	pthread_mutex_unlock(&lock);
+}
+
+struct cache_entry *
+cache_put(const char *key, const struct stat *st, const char *data,
+          size_t len, int *fd, size_t *off)
+{
+	struct cache_entry *e;
+	char *room;
+
+	if (!(e = cache_reserve(key, len, &room))) {
+		return NULL;
+	}
+	memcpy(room, data, len);
+	cache_commit(e, st, len, fd, off);
+
+	return e;
+}
+
+void
+cache_close(struct cache_entry *e)
+{
+	pthread_mutex_lock(&lock);
+	if (--e->refcount == 0 && e->stale) {
+		entry_free(e);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+const char *
+cache_data(size_t off)
+{
+	return arena + off;
+}
@@ -0,0 +1,24 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+struct cache_entry;
+
+void cache_init(size_t);
+struct cache_entry *cache_open(const char *, const struct stat *, int *,
+                               size_t *);
+struct cache_entry *cache_get(const char *, const struct stat *, int *,
+                              size_t *, size_t *);
+struct cache_entry *cache_reserve(const char *, size_t, char **);
+void cache_commit(struct cache_entry *, const struct stat *, size_t, int *,
+                  size_t *);
+void cache_abandon(struct cache_entry *);
+struct cache_entry *cache_put(const char *, const struct stat *,
+                              const char *, size_t, int *, size_t *);
+void cache_close(struct cache_entry *);
+const char *cache_data(size_t);
+
+#endif /* CACHE_H */
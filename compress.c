@@ -0,0 +1,42 @@
+/* See LICENSE file for copyright and license details. */
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "compress.h"
+#include "util.h"
+
+int
+compress_gzip(const char *in, size_t inlen, char *out, size_t *outlen)
+{
+	z_stream z;
+
+	/*
+	 * compress into the *outlen bytes at out, failing if the
+	 * result doesn't fit. The level trades ratio for the time a
+	 * worker spends away from its connections. A window of 15 bits
+	 * plus 16 selects the gzip format
+	 */
+	memset(&z, 0, sizeof(z));
+	if (inlen > UINT_MAX || *outlen > UINT_MAX ||
+	    deflateInit2(&z, COMPRESS_LEVEL, Z_DEFLATED, 15 + 16, 8,
+	                 Z_DEFAULT_STRATEGY) != Z_OK) {
+		return 1;
+	}
+
+	/* compress in one go */
+	z.next_in   = (Bytef *)in;
+	z.avail_in  = inlen;
+	z.next_out  = (Bytef *)out;
+	z.avail_out = *outlen;
+	if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(&z);
+		return 1;
+	}
+	*outlen = z.total_out;
+	deflateEnd(&z);
+
+	return 0;
+}
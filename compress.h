@@ -0,0 +1,9 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+
+int compress_gzip(const char *, size_t, char *, size_t *);
+
+#endif /* COMPRESS_H */
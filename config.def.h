@@ -1,8 +1,46 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
-#define BUFFER_SIZE 4096
-#define FIELD_MAX   200
+#define BUFFER_SIZE       4096
+#define FIELD_MAX         200
+#define CACHE_FILE_MAX    65536
+#define CACHE_LISTING_MAX 1048576
+
+/*
+ * seconds a request may take to arrive in full and a response may
+ * make no progress (idle connections are timed by -k)
+ */
+#define TIMEOUT_HEADER 10
+#define TIMEOUT_SEND   30
+
+/* slots a connection table grows and shrinks by, at most */
+#define TABLE_CHUNK 16
+
+/* connections a worker accepts at most per wakeup */
+#define ACCEPT_BUDGET 32
+
+/* larger directories are listed unsorted, in directory order */
+#define DIRLISTING_SORT_MAX 10000
+
+/* sizes of text files compressed on the fly (-z) */
+#define COMPRESS_FILE_MIN 256
+#define COMPRESS_FILE_MAX 1048576
+
+/* zlib level (1-9) text is compressed at, once per file and change */
+#define COMPRESS_LEVEL 6
+
+/* concurrent streams on an HTTP/2 connection (-2) */
+#define H2_STREAMS_MAX 32
+
+/* precompressed siblings, in order of preference */
+static const struct {
+	char *coding;
+	char *ext;
+} encodings[] = {
+	{ "br",   "br"  },
+	{ "zstd", "zst" },
+	{ "gzip", "gz"  },
+};
 
 /* mime-types */
 static const struct {
@@ -14,6 +52,8 @@ static const struct {
 	{ "html",  "text/html; charset=utf-8" },
 	{ "htm",   "text/html; charset=utf-8" },
 	{ "css",   "text/css; charset=utf-8" },
+	{ "js",    "text/javascript; charset=utf-8" },
+	{ "json",  "application/json" },
 	{ "txt",   "text/plain; charset=utf-8" },
 	{ "md",    "text/plain; charset=utf-8" },
 	{ "c",     "text/plain; charset=utf-8" },
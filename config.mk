@@ -24,5 +24,5 @@ endif
 # flags
 CPPFLAGS = -DVERSION=\"$(VERSION)\" -D_DEFAULT_SOURCE -D_XOPEN_SOURCE=700 -D_BSD_SOURCE
 CFLAGS   = -std=c99 -pedantic -Wall -Wextra -Os
-LDFLAGS  =  -lpthread -s -Wl,--export-dynamic,--dynamic-linker=/lib64/ld-linux-riscv64-lp64d.so.1 -Wl,--as-needed 
+LDFLAGS  =  -lpthread -lz -s -Wl,--export-dynamic,--dynamic-linker=/lib64/ld-linux-riscv64-lp64d.so.1 -Wl,--as-needed 
 
@@ -1,15 +1,21 @@
 /* See LICENSE file for copyright and license details. */
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "cache.h"
+#include "compress.h"
 #include "connection.h"
 #include "data.h"
+#include "fdcache.h"
+#include "h2.h"
 #include "http.h"
 #include "server.h"
 #include "sock.h"
@@ -24,6 +30,10 @@ struct worker_data {
 void
 connection_log(const struct connection *c)
 {
+	static const struct request noreq;
+	static const struct response nores;
+	const struct request *req = (c->req != NULL) ? c->req : &noreq;
+	const struct response *res = (c->res != NULL) ? c->res : &nores;
 	char inaddr_str[INET6_ADDRSTRLEN /* > INET_ADDRSTRLEN */];
 	char tstmp[21];
 
@@ -44,79 +54,815 @@ connection_log(const struct connection *c)
 	printf("%s\t%s\t%s%.*d\t%s\t%s%s%s%s%s\n",
 	       tstmp,
 	       inaddr_str,
-	       (c->res.status == 0) ? "dropped" : "",
-	       (c->res.status == 0) ? 0 : 3,
-	       c->res.status,
-	       c->req.field[REQ_HOST][0] ? c->req.field[REQ_HOST] : "-",
-	       c->req.path[0] ? c->req.path : "-",
-	       c->req.query[0] ? "?" : "",
-	       c->req.query,
-	       c->req.fragment[0] ? "#" : "",
-	       c->req.fragment);
+	       (res->status == 0) ? "dropped" : "",
+	       (res->status == 0) ? 0 : 3,
+	       res->status,
+	       req->field[REQ_HOST][0] ? req->field[REQ_HOST] : "-",
+	       req->path[0] ? req->path : "-",
+	       req->query[0] ? "?" : "",
+	       req->query,
+	       req->fragment[0] ? "#" : "",
+	       req->fragment);
+}
+
+void
+connection_release(struct connection *c)
+{
+	/* give back everything that only lives as long as a request */
+	if (c->cached != NULL) {
+		cache_close(c->cached);
+	} else if (c->filefd > 0) {
+		fdcache_close(c->filefd);
+	}
+	if (c->res != NULL) {
+		free(c->res->listing);
+		pool_put(c->pools->response, c->res);
+	}
+	if (c->req != NULL) {
+		pool_put(c->pools->request, c->req);
+	}
+}
+
+static void
+peer_list(struct connection_table *t, struct connection_peer *p)
+{
+	/* file the peer under the number of connections it holds */
+	p->lprev = NULL;
+	if ((p->lnext = t->level[p->count]) != NULL) {
+		p->lnext->lprev = p;
+	}
+	t->level[p->count] = p;
+}
+
+static void
+peer_unlist(struct connection_table *t, struct connection_peer *p)
+{
+	if (p->lprev != NULL) {
+		p->lprev->lnext = p->lnext;
+	} else {
+		t->level[p->count] = p->lnext;
+	}
+	if (p->lnext != NULL) {
+		p->lnext->lprev = p->lprev;
+	}
+}
+
+static int
+connection_join(struct connection *c)
+{
+	struct connection_table *t = c->chunk->table;
+	struct connection_peer *p, **b;
+	uint32_t addr = sock_hash_addr(&c->ia);
+
+	/* find the peer of our in-address, or start one */
+	b = &t->bucket[addr & (t->nbuckets - 1)];
+	for (p = *b; p != NULL; p = p->next) {
+		if (p->addr == addr && sock_same_addr(&p->first->ia, &c->ia)) {
+			break;
+		}
+	}
+	if (p == NULL) {
+		if (!(p = pool_get(c->pools->peer))) {
+			return 1;
+		}
+		p->next = *b;
+		*b = p;
+		p->first = NULL;
+		p->count = 0;
+		p->addr = addr;
+	} else {
+		peer_unlist(t, p);
+	}
+
+	/* count the connection in */
+	c->peer = p;
+	c->peer_prev = NULL;
+	if ((c->peer_next = p->first) != NULL) {
+		p->first->peer_prev = c;
+	}
+	p->first = c;
+	p->count++;
+	peer_list(t, p);
+	if (p->count > t->maxcount) {
+		t->maxcount = p->count;
+	}
+
+	return 0;
+}
+
+static void
+connection_leave(struct connection *c)
+{
+	struct connection_table *t = c->chunk->table;
+	struct connection_peer *p = c->peer, **b;
+
+	/* count the connection out */
+	if (c->peer_prev != NULL) {
+		c->peer_prev->peer_next = c->peer_next;
+	} else {
+		p->first = c->peer_next;
+	}
+	if (c->peer_next != NULL) {
+		c->peer_next->peer_prev = c->peer_prev;
+	}
+	peer_unlist(t, p);
+	if (--p->count > 0) {
+		peer_list(t, p);
+	} else {
+		/* the in-address has no connections left */
+		for (b = &t->bucket[p->addr & (t->nbuckets - 1)]; *b != p;
+		     b = &(*b)->next)
+			;
+		*b = p->next;
+		pool_put(c->pools->peer, p);
+	}
+
+	/* counts only ever drop by one */
+	if (t->maxcount > 0 && t->level[t->maxcount] == NULL) {
+		t->maxcount--;
+	}
+}
+
+static void
+chunk_unlist(struct connection_table *t, struct connection_chunk *ch)
+{
+	if (ch->prev != NULL) {
+		ch->prev->next = ch->next;
+	} else {
+		t->open = ch->next;
+	}
+	if (ch->next != NULL) {
+		ch->next->prev = ch->prev;
+	} else {
+		t->opentail = ch->prev;
+	}
+	ch->next = ch->prev = NULL;
+}
+
+static void
+chunk_list(struct connection_table *t, struct connection_chunk *ch)
+{
+	if (ch->nused > 0) {
+		/* in use, first */
+		ch->prev = NULL;
+		if ((ch->next = t->open) != NULL) {
+			ch->next->prev = ch;
+		} else {
+			t->opentail = ch;
+		}
+		t->open = ch;
+	} else {
+		/* empty, last */
+		ch->next = NULL;
+		if ((ch->prev = t->opentail) != NULL) {
+			ch->prev->next = ch;
+		} else {
+			t->open = ch;
+		}
+		t->opentail = ch;
+	}
+}
+
+static void
+connection_vacate(struct connection *c)
+{
+	struct connection_chunk *ch = c->chunk;
+	struct connection_table *t = ch->table;
+
+	/* give the slot back to its chunk, which takes its new place */
+	if (ch->vacant != NULL) {
+		chunk_unlist(t, ch);
+	}
+	c->vacant_next = ch->vacant;
+	ch->vacant = c;
+	ch->nused--;
+	t->nused--;
+	chunk_list(t, ch);
 }
 
 void
 connection_reset(struct connection *c)
 {
+	struct connection_chunk *chunk;
+	struct connection_hot *hot;
+
 	if (c != NULL) {
+		if (c->h2 != NULL) {
+			h2_free(c);
+		}
+		wheel_del(&c->timer);
+		connection_release(c);
+		buffer_put(&c->in);
+		buffer_put(&c->buf);
+		if (c->chunk != NULL) {
+			/*
+			 * the event queue must not report anything for
+			 * the slot after it, as its chunk may be freed
+			 */
+			queue_forget_fd(c->chunk->table->queue, c->fd);
+		}
 		shutdown(c->fd, SHUT_RDWR);
 		close(c->fd);
+		if (c->peer != NULL) {
+			connection_leave(c);
+		}
+
+		/*
+		 * the slot keeps its place in its chunk and the hot
+		 * array, now vacant
+		 */
+		chunk = c->chunk;
+		hot = c->hot;
 		memset(c, 0, sizeof(*c));
+		c->fd = -1;
+		c->chunk = chunk;
+		if ((c->hot = hot) != NULL) {
+			memset(c->hot, 0, sizeof(*c->hot));
+		}
+		if (chunk != NULL) {
+			connection_vacate(c);
+		}
+	}
+}
+
+static void
+connection_recycle(struct connection *c)
+{
+	/*
+	 * keep the connection open, waiting for the next request, and
+	 * keep the output of the previous ones if it hasn't been sent
+	 */
+	connection_release(c);
+	if (c->buf.len == 0) {
+		buffer_put(&c->buf);
+	}
+	c->req = NULL;
+	c->res = NULL;
+	c->progress = 0;
+	c->filefd = 0;
+	c->cached = NULL;
+	c->cookie = 0;
+	c->nrequests++;
+	c->state = C_RECV_HEADER;
+}
+
+static void
+connection_sync(struct connection *c)
+{
+	/* publish the fields slot scans look at */
+	c->hot->state = c->state;
+	c->hot->progress = c->progress;
+	c->hot->type = (c->res != NULL) ? c->res->type : 0;
+}
+
+void
+connection_drop(struct connection *c)
+{
+	/* log the connection as dropped, whatever its response was */
+	if (c->res != NULL) {
+		c->res->status = 0;
+	}
+	connection_log(c);
+	connection_reset(c);
+}
+
+int
+connection_attach(struct connection *c)
+{
+	/* take request and response state from the pools */
+	if (c->req == NULL) {
+		if (!(c->req = pool_get(c->pools->request))) {
+			return 1;
+		}
+		memset(c->req, 0, sizeof(*c->req));
+	}
+	if (c->res == NULL) {
+		if (!(c->res = pool_get(c->pools->response))) {
+			return 1;
+		}
+		memset(c->res, 0, sizeof(*c->res));
+	}
+
+	return 0;
+}
+
+static int
+cache_fill_gzip(struct cache_entry *e, char *room, const struct stat *st,
+                const char *data, size_t len, int *fd, size_t *off,
+                size_t *zlen)
+{
+	/*
+	 * compress into the room reserved for it, which is as large as
+	 * the data, as it is only worth it if it gets smaller
+	 */
+	*zlen = len - 1;
+	if (len < 2 || compress_gzip(data, len, room, zlen)) {
+		cache_abandon(e);
+		return 1;
+	}
+	cache_commit(e, st, *zlen, fd, off);
+
+	return 0;
+}
+
+static struct cache_entry *
+cache_put_gzip(const char *key, const struct stat *st, const char *data,
+               size_t len, int *fd, size_t *off, size_t *zlen)
+{
+	struct cache_entry *e;
+	char *room;
+
+	/* only compress what the cache is going to take */
+	if (!(e = cache_reserve(key, len, &room)) ||
+	    cache_fill_gzip(e, room, st, data, len, fd, off, zlen)) {
+		return NULL;
+	}
+
+	return e;
+}
+
+static enum status
+connection_use_gzip(struct connection *c, struct cache_entry *e, int fd,
+                    size_t off, size_t len)
+{
+	/* serve the compressed variant from the content cache */
+	if (c->cached != NULL) {
+		cache_close(c->cached);
+	}
+	free(c->res->listing);
+	c->res->listing = NULL;
+
+	c->cached = e;
+	c->filefd = fd;
+	c->res->type = RESTYPE_CACHED;
+	c->res->file.lower = off;
+	c->res->file.upper = off + len - 1;
+
+	/* ranges would refer to the uncompressed file */
+	c->res->field[RES_ACCEPT_RANGES][0] = '\0';
+	if (esnprintf(c->res->field[RES_CONTENT_LENGTH],
+	              sizeof(c->res->field[RES_CONTENT_LENGTH]), "%zu", len) ||
+	    esnprintf(c->res->field[RES_CONTENT_ENCODING],
+	              sizeof(c->res->field[RES_CONTENT_ENCODING]), "gzip")) {
+		return S_INTERNAL_SERVER_ERROR;
+	}
+
+	return 0;
+}
+
+static void
+connection_prepare_gzip_file(struct connection *c)
+{
+	struct cache_entry *e;
+	struct stat st;
+	ssize_t r;
+	size_t off, len, done;
+	int fd;
+	char key[PATH_MAX + sizeof("\ngzip")], *data, *room;
+
+	/*
+	 * take the compressed file from the content cache or compress
+	 * it into the cache. If the cache doesn't take it (e.g. because
+	 * it isn't requested often enough) or it doesn't get smaller,
+	 * the file is just served uncompressed. The cache is asked
+	 * first, so no work is wasted on what it won't take
+	 */
+	if (esnprintf(key, sizeof(key), "%s\ngzip", c->res->internal_path)) {
+		return;
+	}
+	if (!(e = cache_get(key, &c->res->st, &fd, &off, &len))) {
+		len = c->res->st.st_size;
+		if (!(e = cache_reserve(key, len, &room))) {
+			return;
+		}
+		if ((fd = open(c->res->internal_path, O_RDONLY)) < 0) {
+			cache_abandon(e);
+			return;
+		}
+		if (fstat(fd, &st) < 0 || !same_file(&st, &c->res->st) ||
+		    !(data = malloc(len))) {
+			close(fd);
+			cache_abandon(e);
+			return;
+		}
+		for (done = 0; done < len; done += r) {
+			if ((r = pread(fd, data + done, len - done, done)) <= 0) {
+				break;
+			}
+		}
+		close(fd);
+		if (done < len) {
+			free(data);
+			cache_abandon(e);
+			return;
+		}
+		r = cache_fill_gzip(e, room, &c->res->st, data, len, &fd,
+		                    &off, &len);
+		free(data);
+		if (r) {
+			return;
+		}
+	}
+	if (connection_use_gzip(c, e, fd, off, len)) {
+		http_prepare_error_response(c->req, c->res,
+		                            S_INTERNAL_SERVER_ERROR);
+	}
+}
+
+static enum status
+connection_prepare_dirlisting(struct connection *c)
+{
+	struct cache_entry *e;
+	enum status s;
+	size_t off, len, zoff, zlen;
+	int fd;
+	char key[PATH_MAX * 2], zkey[PATH_MAX * 2 + sizeof("\ngzip")];
+
+	/*
+	 * a listing depends on the directory and the path it is
+	 * requested under. Take it from the content cache or render
+	 * it and try to put it there; an uncached listing is owned
+	 * by the response
+	 */
+	if (esnprintf(key, sizeof(key), "%s\n%s", c->res->internal_path,
+	              c->res->path) ||
+	    esnprintf(zkey, sizeof(zkey), "%s\ngzip", key)) {
+		return S_REQUEST_TOO_LARGE;
+	}
+	if (c->res->compress &&
+	    (e = cache_get(zkey, &c->res->st, &fd, &zoff, &zlen))) {
+		return connection_use_gzip(c, e, fd, zoff, zlen);
+	}
+	if (!(c->cached = cache_get(key, &c->res->st, &c->filefd, &off,
+	                            &len))) {
+		if ((s = data_render_dirlisting(c->res, &c->res->listing,
+		                                &len))) {
+			return s;
+		}
+		if (c->res->listing == NULL) {
+			/*
+			 * the directory is too large to be sorted, so
+			 * its entries are streamed in directory order
+			 * (of unknown length) from an fd we keep
+			 */
+			if ((c->filefd = open(c->res->internal_path,
+			                      O_RDONLY | O_DIRECTORY)) < 0) {
+				c->filefd = 0;
+				return S_FORBIDDEN;
+			}
+			c->cookie = 0;
+			return 0;
+		}
+		if ((c->cached = cache_put(key, &c->res->st, c->res->listing,
+		                           len, &c->filefd, &off))) {
+			free(c->res->listing);
+			c->res->listing = NULL;
+		}
+	}
+	if (c->res->compress &&
+	    (e = cache_put_gzip(zkey, &c->res->st, c->cached ?
+	                        cache_data(off) : c->res->listing, len, &fd,
+	                        &zoff, &zlen))) {
+		return connection_use_gzip(c, e, fd, zoff, zlen);
+	}
+	if (c->cached != NULL) {
+		c->res->type = RESTYPE_CACHED;
+		c->res->file.lower = off;
+	} else {
+		c->res->file.lower = 0;
 	}
+	c->res->file.upper = c->res->file.lower + len - 1;
+
+	if (esnprintf(c->res->field[RES_CONTENT_LENGTH],
+	              sizeof(c->res->field[RES_CONTENT_LENGTH]), "%zu", len)) {
+		return S_INTERNAL_SERVER_ERROR;
+	}
+
+	return 0;
+}
+
+int
+connection_has_body(const struct connection *c)
+{
+	/*
+	 * redirects, 304 and 416 responses have no body but are
+	 * left with the default response type
+	 */
+	return c->req->method == M_GET &&
+	       (c->res->type != RESTYPE_DIRLISTING || c->res->status == S_OK);
+}
+
+enum status
+connection_fill_body_buf(struct connection *c)
+{
+	/* top up the buffer with body data */
+	if (c->res->type == RESTYPE_DIRLISTING && c->res->listing == NULL) {
+		return data_stream_dirlisting(c->res, c->filefd, &c->buf,
+		                              &c->progress, &c->cookie);
+	}
+
+	return data_fct[c->res->type](c->res, c->filefd, &c->buf,
+	                             &c->progress);
+}
+
+int
+connection_body_done(const struct connection *c)
+{
+	/* whether the whole body has made it into the buffer */
+	if (!connection_has_body(c)) {
+		return 1;
+	}
+	if (c->res->type == RESTYPE_DIRLISTING && c->res->listing == NULL) {
+		/* streamed, it is done once a fill comes up empty */
+		return 0;
+	}
+
+	return (c->res->type == RESTYPE_ERROR) ? c->progress > 0 :
+	       c->progress == c->res->file.upper - c->res->file.lower + 1;
 }
 
 void
-connection_serve(struct connection *c, const struct server *srv)
+connection_prepare_response(struct connection *c, const struct server *srv)
 {
 	enum status s;
-	int done;
+	size_t off;
 
-	switch (c->state) {
-	case C_VACANT:
+	/* prepare response struct */
+	http_prepare_response(c->req, c->res, srv);
+
+	/*
+	 * serve small and popular files from the in-memory cache,
+	 * shifting the range to the file's offset in the cache.
+	 * Otherwise open the file once for the lifetime of the
+	 * connection, so the whole body is served from the same
+	 * file even if it is replaced meanwhile (possibly sharing
+	 * an fd with other connections serving the same unchanged
+	 * file)
+	 */
+	if (c->res->type == RESTYPE_FILE && c->res->compress) {
+		connection_prepare_gzip_file(c);
+	}
+	if (c->req->method == M_GET && c->res->type == RESTYPE_FILE) {
+		if ((c->cached = cache_open(c->res->internal_path,
+		                            &c->res->st, &c->filefd,
+		                            &off))) {
+			c->res->type = RESTYPE_CACHED;
+			c->res->file.lower += off;
+			c->res->file.upper += off;
+		} else if ((c->filefd = fdcache_open(
+		            c->res->internal_path, &c->res->st)) < 0) {
+			/* running out of fd's is no reason to deny the file */
+			c->filefd = 0;
+			http_prepare_error_response(c->req, c->res,
+			                            (errno == EACCES) ?
+			                            S_FORBIDDEN :
+			                            (errno == EMFILE ||
+			                             errno == ENFILE) ?
+			                            S_SERVICE_UNAVAILABLE :
+			                            S_NOT_FOUND);
+		}
+	} else if (c->res->type == RESTYPE_DIRLISTING &&
+	           c->res->status == S_OK &&
+	           (s = connection_prepare_dirlisting(c))) {
+		free(c->res->listing);
+		http_prepare_error_response(c->req, c->res, s);
+	}
+}
+
+static int
+connection_make_room(struct connection *c)
+{
+	struct buffer b = { 0 };
+	size_t need = pool_size(c->pools->header);
+
+	/*
+	 * make sure another response header fits behind the output,
+	 * moving it to a large buffer if necessary
+	 */
+	buffer_compact(&c->buf);
+	if (c->buf.size - c->buf.len >= need) {
+		return 0;
+	}
+	if (c->buf.pool == c->pools->body ||
+	    pool_size(c->pools->body) < c->buf.len + need ||
+	    buffer_get(&b, c->pools->body)) {
+		return 1;
+	}
+	memcpy(b.data, c->buf.data, c->buf.len);
+	b.len = c->buf.len;
+	buffer_put(&c->buf);
+	c->buf = b;
+
+	return 0;
+}
+
+static int
+connection_stash(struct connection *c, const char *data, size_t len)
+{
+	/* keep what has been received of the next request */
+	if (c->in.data == NULL && buffer_get(&c->in, c->pools->header)) {
+		return 1;
+	}
+	buffer_compact(&c->in);
+	if (len > c->in.size - c->in.len) {
+		return 1;
+	}
+	memcpy(c->in.data + c->in.len, data, len);
+	c->in.len += len;
+
+	return 0;
+}
+
+static int
+connection_get_body_buf(struct connection *c)
+{
+	const struct connection_pools *p = c->pools;
+	size_t remaining;
+
+	/*
+	 * a body that fits is sent from a header-sized buffer, a larger
+	 * one from a large buffer so it takes fewer trips through the
+	 * event loop. Files are sent by the kernel where possible, which
+	 * leaves the buffer as a mere fallback
+	 */
+	switch (c->res->type) {
+	case RESTYPE_DIRLISTING:
+		if (c->res->listing == NULL) {
+			/* streamed, of unknown length */
+			return buffer_get(&c->buf, p->body);
+		}
+		break;
+	case RESTYPE_ERROR:
+		return buffer_get(&c->buf, p->header);
+	default:
+		#ifdef __linux__
+			return buffer_get(&c->buf, p->header);
+		#endif
+		break;
+	}
+	remaining = c->res->file.upper - c->res->file.lower + 1 - c->progress;
+
+	return buffer_get(&c->buf, (remaining > pool_size(p->header)) ?
+	                  p->body : p->header);
+}
+
+static void
+serve(struct connection *c, const struct server *srv, const char *data,
+      size_t len)
+{
+	enum status s;
+	size_t hlen;
+	int idle;
+
+	if (c->h2 != NULL) {
+		/* the connection has switched to HTTP/2 */
+		h2_serve(c, srv, data, len);
+		return;
+	}
+	if (data != NULL && c->state > C_RECV_HEADER) {
 		/*
-		 * we were passed a "fresh" connection which should now
-		 * try to receive the header, reset buf beforehand
+		 * the event queue has received (part of) the next request
+		 * while we are still responding. Keep it for later or, if
+		 * there is no room, close the connection after the response
 		 */
-		memset(&c->buf, 0, sizeof(c->buf));
-
+		if (connection_stash(c, data, len)) {
+			c->res->keepalive = 0;
+		}
+		data = NULL;
+	}
+next:
+	switch (c->state) {
+	case C_VACANT:
+		/* we were passed a "fresh" connection */
 		c->state = C_RECV_HEADER;
 		/* fallthrough */
 	case C_RECV_HEADER:
-		/* receive header */
-		done = 0;
-		if ((s = http_recv_header(c->fd, &c->buf, &done))) {
-			http_prepare_error_response(&c->req, &c->res, s);
-			goto response;
+		/*
+		 * receive header into a header-sized buffer, unless the
+		 * event queue has already received (part of) it for us.
+		 * The buffer is only taken once something arrives, so
+		 * idle connections between requests don't hold one, and
+		 * is kept as long as it holds pipelined requests
+		 */
+		if (c->in.data == NULL &&
+		    buffer_get(&c->in, c->pools->header)) {
+			goto err;
 		}
-		if (!done) {
+		idle = (c->in.off == c->in.len);
+		s = (data != NULL) ?
+		    http_append_header(&c->in, data, len, &hlen) :
+		    http_recv_header(c->fd, &c->in, &hlen);
+		if (!s && hlen == 0) {
 			/* not done yet */
 			return;
 		}
+		if (s == S_BAD_REQUEST && idle && c->nrequests > 0) {
+			/* the client has closed a connection we kept open */
+			connection_reset(c);
+			return;
+		}
+		if (!s && srv->h2 && c->nrequests == 0 &&
+		    !strcmp(c->in.data + c->in.off, "PRI * HTTP/2.0\r\n")) {
+			/* an HTTP/2 client with prior knowledge */
+			if (h2_start(c, hlen)) {
+				goto err;
+			}
+			h2_serve(c, srv, "", 0);
+			return;
+		}
 
-		/* parse header */
-		if ((s = http_parse_header(c->buf.data, &c->req))) {
-			http_prepare_error_response(&c->req, &c->res, s);
+		/* only now we need request and response state */
+		if (connection_attach(c)) {
+			goto err;
+		}
+		if (s) {
+			http_prepare_error_response(c->req, c->res, s);
+			goto response;
+		}
+
+		/* parse header, what follows is the next request */
+		s = http_parse_header(c->in.data + c->in.off, c->req);
+		if ((c->in.off += hlen) == c->in.len) {
+			buffer_put(&c->in);
+		}
+		if (s) {
+			http_prepare_error_response(c->req, c->res, s);
 			goto response;
 		}
 
+		/*
+		 * switch to HTTP/2 if the client asks for it, unless
+		 * responses are still waiting to be sent
+		 */
+		if (srv->h2 && c->buf.data == NULL && c->req->keepalive &&
+		    http_has_token(c->req->field[REQ_UPGRADE], "h2c") &&
+		    http_has_token(c->req->field[REQ_CONNECTION], "upgrade") &&
+		    c->req->field[REQ_HTTP2_SETTINGS][0] != '\0' &&
+		    !h2_upgrade(c, srv)) {
+			h2_serve(c, srv, "", 0);
+			return;
+		}
+
 		/* prepare response struct */
-		http_prepare_response(&c->req, &c->res, srv);
+		connection_prepare_response(c, srv);
 response:
-		/* generate response header */
-		if ((s = http_prepare_header_buf(&c->res, &c->buf))) {
-			http_prepare_error_response(&c->req, &c->res, s);
-			if ((s = http_prepare_header_buf(&c->res, &c->buf))) {
+		/*
+		 * keep the connection open if the client wants it and
+		 * knows where the response ends
+		 */
+		c->res->keepalive = srv->keepalive && c->req->keepalive &&
+		                    c->nrequests + 1 < srv->maxrequests &&
+		                    (c->req->method == M_HEAD ||
+		                     c->res->status == S_NOT_MODIFIED ||
+		                     c->res->field[RES_CONTENT_LENGTH][0]);
+
+		/* generate response header, behind any earlier responses */
+		if (c->buf.data == NULL &&
+		    buffer_get(&c->buf, c->pools->header)) {
+			c->res->status = S_INTERNAL_SERVER_ERROR;
+			goto err;
+		}
+		if ((s = http_prepare_header_buf(c->res, &c->buf))) {
+			/* the error response replaces a rendered listing */
+			free(c->res->listing);
+			http_prepare_error_response(c->req, c->res, s);
+			if ((s = http_prepare_header_buf(c->res, &c->buf))) {
 				/* couldn't generate the header, we failed for good */
-				c->res.status = s;
+				c->res->status = s;
 				goto err;
 			}
 		}
 
+		/*
+		 * fill the room behind the header with the start of the
+		 * body, so a small response goes out with a single write
+		 */
+		if (connection_has_body(c) &&
+		    (s = connection_fill_body_buf(c))) {
+			c->res->status = s;
+			goto err;
+		}
+
+		/*
+		 * if the response is complete and the next request has
+		 * already arrived, answer that one right away, so the
+		 * responses go out together
+		 */
+		if (c->res->keepalive && connection_body_done(c) &&
+		    c->in.data != NULL && http_header_length(&c->in) > 0 &&
+		    !connection_make_room(c)) {
+			connection_log(c);
+			connection_recycle(c);
+			data = "";
+			len = 0;
+			goto next;
+		}
+
 		c->state = C_SEND_HEADER;
 		/* fallthrough */
 	case C_SEND_HEADER:
 		if ((s = http_send_buf(c->fd, &c->buf))) {
-			c->res.status = s;
+			c->res->status = s;
 			goto err;
 		}
 		if (c->buf.len > 0) {
@@ -127,25 +873,50 @@ response:
 		c->state = C_SEND_BODY;
 		/* fallthrough */
 	case C_SEND_BODY:
-		if (c->req.method == M_GET) {
-			if (c->buf.len == 0) {
-				/* fill buffer with body data */
-				if ((s = data_fct[c->res.type](&c->res, &c->buf,
-				                               &c->progress))) {
+		if (connection_has_body(c)) {
+			if (c->buf.len == 0 && connection_get_body_buf(c)) {
+				c->res->status = S_INTERNAL_SERVER_ERROR;
+				goto err;
+			}
+			if (c->buf.len == 0 && (c->res->type == RESTYPE_FILE ||
+			                        c->res->type == RESTYPE_CACHED)) {
+				/*
+				 * send file directly from the page cache,
+				 * falling back to filling the buffer
+				 */
+				if ((s = data_send_file(c->fd, c->res, c->filefd,
+				                        &c->buf, &c->progress))) {
 					/* too late to do any real error handling */
-					c->res.status = s;
+					c->res->status = s;
 					goto err;
 				}
 
 				/* if the buffer remains empty, we are done */
-				if (c->buf.len == 0) {
+				if (c->buf.len == 0 && c->progress ==
+				    c->res->file.upper - c->res->file.lower + 1) {
 					break;
 				}
 			} else {
+				/*
+				 * top up the buffer with body data, so
+				 * partial sends are followed by full-sized
+				 * writes, and send what we can
+				 */
+				if ((s = connection_fill_body_buf(c))) {
+					/* too late to do any real error handling */
+					c->res->status = s;
+					goto err;
+				}
+
+				/* if the buffer remains empty, we are done */
+				if (c->buf.len == 0) {
+					break;
+				}
+
 				/* send buffer */
 				if ((s = http_send_buf(c->fd, &c->buf))) {
 					/* too late to do any real error handling */
-					c->res.status = s;
+					c->res->status = s;
 					goto err;
 				}
 			}
@@ -156,108 +927,316 @@ response:
 		warn("serve: invalid connection state");
 		return;
 	}
+
+	/* the response is complete */
+	if (c->res->keepalive) {
+		connection_log(c);
+		connection_recycle(c);
+		if (c->in.data != NULL) {
+			/*
+			 * look for a pipelined request among what we have
+			 * already received, without reading concurrently
+			 * to the event queue
+			 */
+			data = "";
+			len = 0;
+			goto next;
+		}
+		return;
+	}
 err:
 	connection_log(c);
 	connection_reset(c);
 }
 
-static struct connection *
-connection_get_drop_candidate(struct connection *connection, size_t nslots)
+void
+connection_serve(struct connection *c, const struct server *srv,
+                 const char *data, size_t len)
 {
-	struct connection *c, *minc;
-	size_t i, j, maxcnt, cnt;
+	serve(c, srv, data, len);
+
+	if (c->fd >= 0) {
+		connection_sync(c);
+	}
+}
 
+void
+connection_arm(struct connection *c, const struct server *srv,
+               struct wheel *w, time_t now)
+{
 	/*
-	 * determine the most-unimportant connection 'minc' of the in-address
-	 * with most connections; this algorithm has a complexity of O(n²)
-	 * in time but is O(1) in space; there are algorithms with O(n) in
-	 * time and space, but this would require memory allocation,
-	 * which we avoid. Given the simplicity of the inner loop and
-	 * relatively small number of slots per thread, this is fine.
+	 * a response has to make progress within the send timeout, a
+	 * request has to arrive in full within the header timeout of
+	 * its first byte (or of the connection's start), and between
+	 * requests a connection may idle for the keep-alive timeout.
+	 * Deadlines are rounded up to the next second
 	 */
-	for (i = 0, minc = NULL, maxcnt = 0; i < nslots; i++) {
-		/*
-		 * we determine how many connections have the same
-		 * in-address as connection[i], but also minimize over
-		 * that set with other criteria, yielding a general
-		 * minimizer c. We first set it to connection[i] and
-		 * update it, if a better candidate shows up, in the inner
-		 * loop
-		 */
-		c = &connection[i];
+	c->timer.data = c;
+	if (c->state > C_RECV_HEADER || (c->h2 != NULL && h2_busy(c))) {
+		c->timeout = T_SEND;
+		wheel_add(w, &c->timer, now + TIMEOUT_SEND + 1);
+	} else if (c->h2 != NULL ||
+	           (c->nrequests > 0 && c->in.off == c->in.len)) {
+		c->timeout = T_IDLE;
+		wheel_add(w, &c->timer, now + srv->keepalive + 1);
+	} else if (c->timeout != T_HEADER) {
+		c->timeout = T_HEADER;
+		wheel_add(w, &c->timer, now + TIMEOUT_HEADER + 1);
+	}
+}
 
-		for (j = 0, cnt = 0; j < nslots; j++) {
-			if (!sock_same_addr(&connection[i].ia,
-			                    &connection[j].ia)) {
-				continue;
-			}
-			cnt++;
-
-			/* minimize over state */
-			if (connection[j].state < c->state) {
-				c = &connection[j];
-			} else if (connection[j].state == c->state) {
-				/* minimize over progress */
-				if (c->state == C_SEND_BODY &&
-				    connection[i].res.type != c->res.type) {
-					/*
-					 * mixed response types; progress
-					 * is not comparable
-					 *
-					 * the res-type-enum is ordered as
-					 * DIRLISTING, ERROR, FILE, i.e.
-					 * in rising priority, because a
-					 * file transfer is most important,
-					 * followed by error-messages.
-					 * Dirlistings as an "interactive"
-					 * feature (that take up lots of
-					 * resources) have the lowest
-					 * priority
-					 */
-					if (connection[i].res.type <
-					    c->res.type) {
-						c = &connection[j];
-					}
-				} else if (connection[j].progress <
-				           c->progress) {
-					/*
-					 * for C_SEND_BODY with same response
-					 * type, C_RECV_HEADER and C_SEND_BODY
-					 * it is sufficient to compare the
-					 * raw progress
-					 */
-					c = &connection[j];
-				}
-			}
+void
+connection_expire(struct connection *c)
+{
+	/*
+	 * close a connection that has run out of time, logging it as
+	 * dropped if it was caught in the middle of a request
+	 */
+	if (c->h2 == NULL && (c->state > C_RECV_HEADER ||
+	                      c->in.len > c->in.off)) {
+		connection_drop(c);
+	} else {
+		connection_reset(c);
+	}
+}
+
+int
+connection_budget_init(struct connection_budget *b, size_t nthreads,
+                       size_t nslots)
+{
+	if ((errno = pthread_mutex_init(&b->lock, NULL))) {
+		warn("pthread_mutex_init:");
+		return 1;
+	}
+
+	/*
+	 * nthreads * nslots slots in total, of which each thread's
+	 * first chunk is set aside for it, so every table has one
+	 */
+	b->left = nthreads * (nslots - MIN(TABLE_CHUNK, nslots));
+
+	return 0;
+}
+
+static int
+connection_table_index(struct connection_table *t, size_t nslots)
+{
+	struct connection_peer **bucket, **level, *p, *next;
+	size_t i, nbuckets, nlevels;
+
+	/* a level for each count a peer can reach */
+	if (nslots + 1 > t->nlevels) {
+		nlevels = MAX(nslots + 1, 2 * t->nlevels);
+		if (!(level = reallocarray(t->level, nlevels,
+		                           sizeof(*level)))) {
+			/* the table stays as it is */
+			warn("reallocarray:");
+			return 1;
 		}
+		memset(level + t->nlevels, 0,
+		       (nlevels - t->nlevels) * sizeof(*level));
+		t->level = level;
+		t->nlevels = nlevels;
+	}
 
-		if (cnt > maxcnt) {
-			/* this run yielded an even greedier in-address */
-			minc = c;
-			maxcnt = cnt;
+	/* a power of two of hash buckets, at least one per slot */
+	if (nslots > t->nbuckets) {
+		for (nbuckets = MAX(t->nbuckets, 1); nbuckets < nslots;
+		     nbuckets <<= 1)
+			;
+		if (!(bucket = calloc(nbuckets, sizeof(*bucket)))) {
+			warn("calloc:");
+			return 1;
 		}
+		for (i = 0; i < t->nbuckets; i++) {
+			for (p = t->bucket[i]; p != NULL; p = next) {
+				next = p->next;
+				p->next = bucket[p->addr & (nbuckets - 1)];
+				bucket[p->addr & (nbuckets - 1)] = p;
+			}
+		}
+		free(t->bucket);
+		t->bucket = bucket;
+		t->nbuckets = nbuckets;
 	}
 
-	return minc;
+	return 0;
 }
 
-struct connection *
-connection_accept(int insock, struct connection *connection, size_t nslots)
+static int
+connection_table_add(struct connection_table *t, size_t nslots)
 {
-	struct connection *c = NULL;
+	struct connection_chunk *ch;
 	size_t i;
 
-	/* find vacant connection (i.e. one with no fd assigned to it) */
+	if (!(ch = calloc(1, sizeof(*ch))) ||
+	    !(ch->slot = calloc(nslots, sizeof(*ch->slot))) ||
+	    !(ch->hot = calloc(nslots, sizeof(*ch->hot)))) {
+		warn("calloc:");
+		if (ch != NULL) {
+			free(ch->slot);
+		}
+		free(ch);
+		return 1;
+	}
+	if (connection_table_index(t, t->nslots + nslots)) {
+		free(ch->hot);
+		free(ch->slot);
+		free(ch);
+		return 1;
+	}
 	for (i = 0; i < nslots; i++) {
-		if (connection[i].fd == 0) {
-			c = &connection[i];
-			break;
+		ch->slot[i].fd = -1;
+		ch->slot[i].hot = &ch->hot[i];
+		ch->slot[i].chunk = ch;
+		ch->slot[i].vacant_next = (i + 1 < nslots) ?
+		                          &ch->slot[i + 1] : NULL;
+	}
+	ch->table = t;
+	ch->vacant = ch->slot;
+	ch->nslots = nslots;
+	chunk_list(t, ch);
+	t->nchunks++;
+	t->nslots += nslots;
+
+	return 0;
+}
+
+static int
+connection_table_grow(struct connection_table *t)
+{
+	size_t n;
+
+	/* take another chunk from the budget, or what is left of it */
+	pthread_mutex_lock(&t->budget->lock);
+	n = MIN(t->chunksize, t->budget->left);
+	t->budget->left -= n;
+	pthread_mutex_unlock(&t->budget->lock);
+
+	if (n == 0 || connection_table_add(t, n)) {
+		pthread_mutex_lock(&t->budget->lock);
+		t->budget->left += n;
+		pthread_mutex_unlock(&t->budget->lock);
+		return 1;
+	}
+
+	return 0;
+}
+
+void
+connection_table_shrink(struct connection_table *t)
+{
+	struct connection_chunk *ch;
+
+	/*
+	 * give the empty chunks back to the budget, as long as a
+	 * chunk's worth of vacant slots remains for the next
+	 * connections. We are called between two waits for events,
+	 * so none of them refers to a slot in a freed chunk
+	 */
+	while ((ch = t->opentail) != NULL && ch->nused == 0 &&
+	       t->nchunks > 1 &&
+	       t->nslots - t->nused - ch->nslots >= t->chunksize) {
+		chunk_unlist(t, ch);
+		t->nchunks--;
+		t->nslots -= ch->nslots;
+
+		pthread_mutex_lock(&t->budget->lock);
+		t->budget->left += ch->nslots;
+		pthread_mutex_unlock(&t->budget->lock);
+
+		free(ch->hot);
+		free(ch->slot);
+		free(ch);
+	}
+}
+
+int
+connection_table_init(struct connection_table *t, size_t nslots,
+                      struct connection_budget *budget, struct queue *q)
+{
+	memset(t, 0, sizeof(*t));
+	t->budget = budget;
+	t->queue = q;
+
+	/* start out with the chunk set aside for us */
+	t->chunksize = MIN(TABLE_CHUNK, nslots);
+
+	return connection_table_add(t, t->chunksize);
+}
+
+static struct connection *
+connection_get_drop_candidate(struct connection_table *t)
+{
+	struct connection *c, *minc;
+	const struct connection_hot *hot, *minhot;
+
+	/*
+	 * determine the most-unimportant connection 'minc' of the
+	 * in-address with most connections. Each in-address is counted
+	 * as its connections come and go, so the greediest one is
+	 * known without looking at the slots, and only its own
+	 * connections are compared. Their order can't be kept along
+	 * the way, as their progress changes with every write.
+	 * All memory for this is allocated with the table.
+	 */
+	minc = t->level[t->maxcount]->first;
+	for (c = minc->peer_next; c != NULL; c = c->peer_next) {
+		hot = c->hot;
+		minhot = minc->hot;
+
+		/* minimize over state */
+		if (hot->state < minhot->state) {
+			minc = c;
+		} else if (hot->state == minhot->state) {
+			/* minimize over progress */
+			if (minhot->state == C_SEND_BODY &&
+			    hot->type != minhot->type) {
+				/*
+				 * mixed response types; progress
+				 * is not comparable
+				 *
+				 * the res-type-enum is ordered as
+				 * DIRLISTING, ERROR, CACHED, FILE,
+				 * i.e. in rising priority, because a
+				 * file transfer is most important,
+				 * followed by (small) cached files
+				 * and error-messages.
+				 * Dirlistings as an "interactive"
+				 * feature (that take up lots of
+				 * resources) have the lowest
+				 * priority
+				 */
+				if (hot->type < minhot->type) {
+					minc = c;
+				}
+			} else if (hot->progress < minhot->progress) {
+				/*
+				 * for C_SEND_BODY with same response
+				 * type, C_RECV_HEADER and C_SEND_BODY
+				 * it is sufficient to compare the
+				 * raw progress
+				 */
+				minc = c;
+			}
 		}
 	}
-	if (i == nslots) {
+
+	return minc;
+}
+
+static struct connection *
+connection_get_vacant(struct connection_table *t)
+{
+	struct connection_chunk *ch;
+	struct connection *c;
+
+	/* take a vacant slot from the table, growing it if need be */
+	if (t->open == NULL && connection_table_grow(t)) {
 		/*
-		 * all our connection-slots are occupied and the only
-		 * way out is to drop another connection, because not
+		 * all our connection-slots are occupied, the budget
+		 * shared with the other threads is used up, and the
+		 * only way out is to drop another connection, because not
 		 * accepting this connection just kicks this can further
 		 * down the road (to the next queue_wait()) without
 		 * solving anything.
@@ -286,28 +1265,89 @@ connection_accept(int insock, struct connection *connection, size_t nslots)
 		 * connections while preserving even long-running
 		 * benevolent connections like downloads.
 		 */
-		c = connection_get_drop_candidate(connection, nslots);
-		c->res.status = 0;
-		connection_log(c);
-		connection_reset(c);
+		connection_drop(connection_get_drop_candidate(t));
+	}
+	ch = t->open;
+	c = ch->vacant;
+	ch->vacant = c->vacant_next;
+	c->vacant_next = NULL;
+	ch->nused++;
+	t->nused++;
+	if (ch->vacant == NULL) {
+		/* the chunk is full */
+		chunk_unlist(t, ch);
+	}
+
+	return c;
+}
+
+static int
+connection_occupy(struct connection *c)
+{
+	if (connection_join(c)) {
+		return 1;
 	}
+	connection_sync(c);
+
+	return 0;
+}
 
-	/* accept connection */
-	if ((c->fd = accept(insock, (struct sockaddr *)&c->ia,
-	                    &(socklen_t){sizeof(c->ia)})) < 0) {
+struct connection *
+connection_accept(int insock, struct connection_table *t,
+                  const struct connection_pools *pools)
+{
+	struct connection *c;
+	struct sockaddr_storage ia;
+	int fd;
+
+	/*
+	 * accept connection before taking a slot, as we are called
+	 * until the backlog is drained and must not drop a
+	 * connection for nothing
+	 */
+	if ((fd = sock_accept(insock, &ia)) < 0) {
 		if (errno != EAGAIN && errno != EWOULDBLOCK) {
-			/*
-			 * this should not happen, as we received the
-			 * event that there are pending connections here
-			 */
 			warn("accept:");
 		}
 		return NULL;
 	}
 
-	/* set socket to non-blocking mode */
-	if (sock_set_nonblocking(c->fd)) {
-		/* we can't allow blocking sockets */
+	c = connection_get_vacant(t);
+	c->pools = pools;
+	c->fd = fd;
+	c->ia = ia;
+	if (connection_occupy(c)) {
+		connection_reset(c);
+		return NULL;
+	}
+
+	return c;
+}
+
+struct connection *
+connection_adopt(int fd, struct connection_table *t,
+                 const struct connection_pools *pools)
+{
+	struct connection *c = connection_get_vacant(t);
+
+	c->pools = pools;
+
+	/*
+	 * the connection has already been accepted (in non-blocking
+	 * mode) by the event queue, which doesn't hand us the
+	 * in-address
+	 */
+	c->fd = fd;
+	if (getpeername(c->fd, (struct sockaddr *)&c->ia,
+	                &(socklen_t){sizeof(c->ia)}) < 0) {
+		warn("getpeername:");
+		close(c->fd);
+		c->fd = -1;
+		connection_vacate(c);
+		return NULL;
+	}
+	if (connection_occupy(c)) {
+		connection_reset(c);
 		return NULL;
 	}
 
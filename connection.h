@@ -2,9 +2,17 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "cache.h"
 #include "http.h"
+#include "pool.h"
+#include "queue.h"
 #include "server.h"
 #include "util.h"
+#include "wheel.h"
 
 enum connection_state {
 	C_VACANT,
@@ -14,19 +22,140 @@ enum connection_state {
 	NUM_CONN_STATES,
 };
 
+enum connection_timeout {
+	T_NONE,
+	T_HEADER,
+	T_IDLE,
+	T_SEND,
+};
+
+/*
+ * per-worker pools the connections take their buffers and their
+ * request and response state from, as long as they need them
+ */
+struct connection_pools {
+	struct pool *header;
+	struct pool *body;
+	struct pool *request;
+	struct pool *response;
+	struct pool *peer;
+};
+
+/*
+ * the fields slot scans look at, kept in an array parallel to the
+ * slots and updated whenever a connection has been served
+ */
+struct connection_hot {
+	size_t progress;
+	unsigned char state;
+	unsigned char type;
+};
+
+struct h2;
+struct connection_chunk;
+
+/*
+ * an in-address and the connections it holds, found by its hash.
+ * Peers are also listed by how many connections they hold, so the
+ * greediest one is always at hand
+ */
+struct connection_peer {
+	struct connection_peer *next;
+	struct connection_peer *lnext;
+	struct connection_peer *lprev;
+	struct connection *first;
+	size_t count;
+	uint32_t addr;
+};
+
 struct connection {
 	enum connection_state state;
 	int fd;
 	struct sockaddr_storage ia;
-	struct request req;
-	struct response res;
+	struct connection_hot *hot;
+	struct connection_chunk *chunk;
+	struct connection_peer *peer;
+	struct connection *peer_next;
+	struct connection *peer_prev;
+	struct connection *vacant_next;
+	const struct connection_pools *pools;
+	struct request *req;
+	struct response *res;
+	struct buffer in;
 	struct buffer buf;
 	size_t progress;
+	int filefd;
+	struct cache_entry *cached;
+	off_t cookie;
+	size_t nrequests;
+	struct h2 *h2;
+	struct timer timer;
+	enum connection_timeout timeout;
+};
+
+/* the connection slots all worker threads take their chunks from */
+struct connection_budget {
+	pthread_mutex_t lock;
+	size_t left;
+};
+
+/*
+ * a table grows and shrinks by chunks of slots, which never move, so
+ * the event queue and the timers can point at their connections
+ */
+struct connection_chunk {
+	struct connection_chunk *next;
+	struct connection_chunk *prev;
+	struct connection_table *table;
+	struct connection *slot;
+	struct connection_hot *hot;
+	struct connection *vacant;
+	size_t nslots;
+	size_t nused;
+};
+
+/*
+ * the chunks with vacant slots are listed with those in use first and
+ * the empty ones last, which are given back when there are enough
+ * vacant slots without them. Full chunks are not listed
+ */
+struct connection_table {
+	struct connection_budget *budget;
+	struct queue *queue;
+	struct connection_chunk *open;
+	struct connection_chunk *opentail;
+	size_t chunksize;
+	size_t nchunks;
+	size_t nslots;
+	size_t nused;
+	struct connection_peer **bucket;
+	size_t nbuckets;
+	struct connection_peer **level;
+	size_t nlevels;
+	size_t maxcount;
 };
 
-struct connection *connection_accept(int, struct connection *, size_t);
+int connection_budget_init(struct connection_budget *, size_t, size_t);
+int connection_table_init(struct connection_table *, size_t,
+                          struct connection_budget *, struct queue *);
+void connection_table_shrink(struct connection_table *);
+struct connection *connection_accept(int, struct connection_table *,
+                                     const struct connection_pools *);
+struct connection *connection_adopt(int, struct connection_table *,
+                                    const struct connection_pools *);
 void connection_log(const struct connection *);
+void connection_release(struct connection *);
+int connection_attach(struct connection *);
+void connection_prepare_response(struct connection *, const struct server *);
+int connection_has_body(const struct connection *);
+enum status connection_fill_body_buf(struct connection *);
+int connection_body_done(const struct connection *);
+void connection_drop(struct connection *);
 void connection_reset(struct connection *);
-void connection_serve(struct connection *, const struct server *);
+void connection_serve(struct connection *, const struct server *,
+                      const char *, size_t);
+void connection_arm(struct connection *, const struct server *,
+                    struct wheel *, time_t);
+void connection_expire(struct connection *);
 
 #endif /* CONNECTION_H */
@@ -0,0 +1,168 @@
+/* See LICENSE file for copyright and license details. */
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+	#include <sys/syscall.h>
+#endif
+
+#include "cpu.h"
+#include "util.h"
+
+#define BITS (8 * sizeof(unsigned long))
+
+static int
+cpu_isset(const struct cpuset *s, size_t cpu)
+{
+	return (s->bits[cpu / BITS] >> (cpu % BITS)) & 1;
+}
+
+int
+cpu_get_allowed(struct cpuset *s)
+{
+	memset(s, 0, sizeof(*s));
+
+	#ifdef __linux__
+		/* the affinity mask we were started with (e.g. by taskset) */
+		if (syscall(__NR_sched_getaffinity, 0, sizeof(s->bits),
+		            s->bits) < 0) {
+			warn("sched_getaffinity:");
+			return 1;
+		}
+
+		return 0;
+	#else
+		return 1;
+	#endif
+}
+
+size_t
+cpu_count(const struct cpuset *s)
+{
+	size_t cpu, n;
+
+	for (cpu = 0, n = 0; cpu < CPU_MAX; cpu++) {
+		n += cpu_isset(s, cpu);
+	}
+
+	return n;
+}
+
+#ifdef __linux__
+static size_t
+cgroup_quota(const char *cgroup)
+{
+	FILE *fp;
+	long long quota, period;
+	char path[PATH_MAX];
+	int n;
+
+	/* cpu.max holds "max" or the quota and the period, in µs */
+	if (esnprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max",
+	              cgroup) || !(fp = fopen(path, "r"))) {
+		return 0;
+	}
+	n = fscanf(fp, "%lld %lld", &quota, &period);
+	fclose(fp);
+	if (n != 2 || quota <= 0 || period <= 0) {
+		return 0;
+	}
+
+	/* round up, a fraction of a CPU still wants a thread */
+	return (quota + period - 1) / period;
+}
+#endif
+
+size_t
+cpu_get_quota(void)
+{
+	#ifdef __linux__
+		FILE *fp;
+		size_t n, quota = 0;
+		char line[PATH_MAX], *cgroup = NULL, *p;
+
+		/* find our cgroup (v2), i.e. the "0::/path" entry */
+		if (!(fp = fopen("/proc/self/cgroup", "r"))) {
+			return 0;
+		}
+		while (fgets(line, sizeof(line), fp)) {
+			if (!strncmp(line, "0::", sizeof("0::") - 1)) {
+				cgroup = line + sizeof("0::") - 1;
+				cgroup[strcspn(cgroup, "\n")] = '\0';
+				break;
+			}
+		}
+		fclose(fp);
+		if (cgroup == NULL) {
+			return 0;
+		}
+
+		/* the tightest quota on the way up to the root applies */
+		for (;;) {
+			if ((n = cgroup_quota(cgroup)) > 0 &&
+			    (quota == 0 || n < quota)) {
+				quota = n;
+			}
+			if (!(p = strrchr(cgroup, '/')) || p == cgroup) {
+				break;
+			}
+			*p = '\0';
+		}
+
+		return quota;
+	#else
+		return 0;
+	#endif
+}
+
+void
+cpu_select(const struct cpuset *allowed, size_t i, size_t n,
+           struct cpuset *s)
+{
+	size_t cpu, k, count;
+
+	/*
+	 * the share of the i-th of n threads: the allowed CPUs whose
+	 * number is i modulo n, which are those a connection to its
+	 * listening socket arrives on (see sock_steer_cpu()). If there
+	 * are none, because there are more threads than CPUs, it is
+	 * the (i modulo count)-th allowed CPU
+	 */
+	memset(s, 0, sizeof(*s));
+	for (cpu = 0, count = 0; cpu < CPU_MAX; cpu++) {
+		if (cpu_isset(allowed, cpu) && cpu % n == i) {
+			s->bits[cpu / BITS] |= 1UL << (cpu % BITS);
+			count++;
+		}
+	}
+	if (count > 0 || (count = cpu_count(allowed)) == 0) {
+		return;
+	}
+	for (cpu = 0, k = i % count; cpu < CPU_MAX; cpu++) {
+		if (cpu_isset(allowed, cpu) && k-- == 0) {
+			s->bits[cpu / BITS] |= 1UL << (cpu % BITS);
+			break;
+		}
+	}
+}
+
+int
+cpu_pin(const struct cpuset *s)
+{
+	#ifdef __linux__
+		/* restrict the calling thread to the set */
+		if (syscall(__NR_sched_setaffinity, 0, sizeof(s->bits),
+		            s->bits) < 0) {
+			warn("sched_setaffinity:");
+			return 1;
+		}
+
+		return 0;
+	#else
+		(void)s;
+
+		return 1;
+	#endif
+}
@@ -0,0 +1,21 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef CPU_H
+#define CPU_H
+
+#include <stddef.h>
+
+/* CPUs beyond this number are ignored */
+#define CPU_MAX 1024
+
+/* a set of CPUs, by number */
+struct cpuset {
+	unsigned long bits[CPU_MAX / (8 * sizeof(unsigned long))];
+};
+
+int cpu_get_allowed(struct cpuset *);
+size_t cpu_count(const struct cpuset *);
+size_t cpu_get_quota(void);
+void cpu_select(const struct cpuset *, size_t, size_t, struct cpuset *);
+int cpu_pin(const struct cpuset *);
+
+#endif /* CPU_H */
@@ -1,35 +1,65 @@
 /* See LICENSE file for copyright and license details. */
 #include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+	#include <sys/sendfile.h>
+	#include <sys/syscall.h>
+#endif
+
+#include "cache.h"
+#include "config.h"
 #include "data.h"
 #include "http.h"
 #include "util.h"
 
-enum status (* const data_fct[])(const struct response *,
+enum status (* const data_fct[])(const struct response *, int,
                                  struct buffer *, size_t *) = {
 	[RESTYPE_DIRLISTING] = data_prepare_dirlisting_buf,
 	[RESTYPE_ERROR]      = data_prepare_error_buf,
+	[RESTYPE_CACHED]     = data_prepare_cached_buf,
 	[RESTYPE_FILE]       = data_prepare_file_buf,
 };
 
+struct dirlisting_entry {
+	unsigned char type;
+	char name[];
+};
+
+#ifdef __linux__
+/* as returned by getdents64(2) */
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+#endif
+
 static int
-compareent(const struct dirent **d1, const struct dirent **d2)
+compareent(const void *p1, const void *p2)
 {
+	const struct dirlisting_entry *d1, *d2;
 	int v;
 
-	v = ((*d2)->d_type == DT_DIR ? 1 : -1) -
-	    ((*d1)->d_type == DT_DIR ? 1 : -1);
+	d1 = *(struct dirlisting_entry * const *)p1;
+	d2 = *(struct dirlisting_entry * const *)p2;
+
+	v = (d2->type == DT_DIR ? 1 : -1) - (d1->type == DT_DIR ? 1 : -1);
 	if (v) {
 		return v;
 	}
 
-	return strcmp((*d1)->d_name, (*d2)->d_name);
+	return strcmp(d1->name, d2->name);
 }
 
 static char *
@@ -90,70 +120,125 @@ html_escape(const char *src, char *dst, size_t dst_siz)
 	dst[j] = '\0';
 }
 
+static int
+append_listing_header(const struct response *res, struct buffer *buf)
+{
+	char esc[PATH_MAX * 6]; /* strlen("&...;") <= 6 */
+
+	/* (sizeof(esc) >= PATH_MAX) */
+	html_escape(res->path, esc, MIN(PATH_MAX, sizeof(esc)));
+	return buffer_appendf(buf, "<!DOCTYPE html>\n<html>\n\t<head>"
+	                      "<title>Index of %s</title></head>\n"
+	                      "\t<body>\n\t\t<a href=\"..\">..</a>", esc);
+}
+
+static int
+append_listing_entry(const char *name, unsigned char type,
+                     struct buffer *buf)
+{
+	char esc[NAME_MAX * 6]; /* strlen("&...;") <= 6 */
+
+	html_escape(name, esc, sizeof(esc));
+	return buffer_appendf(buf, "<br />\n\t\t<a href=\"%s%s\">%s%s</a>",
+	                      esc, (type == DT_DIR) ? "/" : "", esc,
+	                      suffix(type));
+}
+
+static int
+append_listing_footer(struct buffer *buf)
+{
+	return buffer_appendf(buf, "\n\t</body>\n</html>\n");
+}
+
 enum status
-data_prepare_dirlisting_buf(const struct response *res,
-                            struct buffer *buf, size_t *progress)
+data_render_dirlisting(const struct response *res, char **listing,
+                       size_t *len)
 {
 	enum status s = 0;
-	struct dirent **e;
-	size_t i;
-	int dirlen;
-	char esc[PATH_MAX /* > NAME_MAX */ * 6]; /* strlen("&...;") <= 6 */
+	struct dirlisting_entry **e = NULL, **tmp;
+	struct dirent *d;
+	struct buffer buf;
+	FILE *fp = NULL;
+	DIR *dir;
+	size_t i, n = 0, nalloc = 0;
+	char data[BUFFER_SIZE];
 
-	/* reset buffer */
-	memset(buf, 0, sizeof(*buf));
+	*listing = NULL;
 
-	/* read directory */
-	if ((dirlen = scandir(res->internal_path, &e, NULL, compareent)) < 0) {
+	/* read the visible entries ("." and ".." are hidden too) */
+	if (!(dir = opendir(res->internal_path))) {
 		return S_FORBIDDEN;
 	}
-
-	if (*progress == 0) {
-		/* write listing header (sizeof(esc) >= PATH_MAX) */
-		html_escape(res->path, esc, MIN(PATH_MAX, sizeof(esc)));
-		if (buffer_appendf(buf,
-		                   "<!DOCTYPE html>\n<html>\n\t<head>"
-		                   "<title>Index of %s</title></head>\n"
-		                   "\t<body>\n\t\t<a href=\"..\">..</a>",
-		                   esc) < 0) {
-			s = S_REQUEST_TIMEOUT;
+	while ((d = readdir(dir))) {
+		if (d->d_name[0] == '.') {
+			continue;
+		}
+		#ifdef __linux__
+		if (n == DIRLISTING_SORT_MAX) {
+			/*
+			 * too large to be sorted in memory, leave the
+			 * listing NULL so it is streamed instead
+			 */
 			goto cleanup;
 		}
-	}
-
-	/* listing entries */
-	for (i = *progress; i < (size_t)dirlen; i++) {
-		/* skip hidden files, "." and ".." */
-		if (e[i]->d_name[0] == '.') {
-			continue;
+		#endif
+		if (n == nalloc) {
+			nalloc = nalloc ? 2 * nalloc : 64;
+			if (!(tmp = reallocarray(e, nalloc, sizeof(*e)))) {
+				s = S_INTERNAL_SERVER_ERROR;
+				goto cleanup;
+			}
+			e = tmp;
 		}
-
-		/* entry line */
-		html_escape(e[i]->d_name, esc, sizeof(esc));
-		if (buffer_appendf(buf,
-		                   "<br />\n\t\t<a href=\"%s%s\">%s%s</a>",
-		                   esc,
-		                   (e[i]->d_type == DT_DIR) ? "/" : "",
-		                   esc,
-		                   suffix(e[i]->d_type))) {
-			/* buffer full */
-			break;
+		if (!(e[n] = malloc(sizeof(**e) + strlen(d->d_name) + 1))) {
+			s = S_INTERNAL_SERVER_ERROR;
+			goto cleanup;
 		}
+		e[n]->type = d->d_type;
+		strcpy(e[n]->name, d->d_name);
+		n++;
 	}
-	*progress = i;
+	qsort(e, n, sizeof(*e), compareent);
 
-	if (*progress == (size_t)dirlen) {
-		/* listing footer */
-		if (buffer_appendf(buf, "\n\t</body>\n</html>\n") < 0) {
-			s = S_REQUEST_TIMEOUT;
+	/*
+	 * render the whole listing once, so it can be sent in slices
+	 * (and possibly be cached) with a known length
+	 */
+	if (!(fp = open_memstream(listing, len))) {
+		s = S_INTERNAL_SERVER_ERROR;
+		goto cleanup;
+	}
+	buf.data = data;
+	buf.size = sizeof(data);
+	buf.len = 0;
+	if (append_listing_header(res, &buf)) {
+		s = S_REQUEST_TOO_LARGE;
+		goto cleanup;
+	}
+	fwrite(buf.data, 1, buf.len, fp);
+	for (i = 0; i <= n; i++) {
+		/* entries, followed by the footer */
+		buf.len = 0;
+		if ((i < n) ? append_listing_entry(e[i]->name, e[i]->type,
+		                                   &buf) :
+		              append_listing_footer(&buf)) {
+			s = S_INTERNAL_SERVER_ERROR;
 			goto cleanup;
 		}
-		(*progress)++;
+		fwrite(buf.data, 1, buf.len, fp);
 	}
 
 cleanup:
-	while (dirlen--) {
-		free(e[dirlen]);
+	if (fp != NULL && (ferror(fp) | fclose(fp) | s)) {
+		free(*listing);
+		*listing = NULL;
+		if (!s) {
+			s = S_INTERNAL_SERVER_ERROR;
+		}
+	}
+	closedir(dir);
+	while (n--) {
+		free(e[n]);
 	}
 	free(e);
 
@@ -161,22 +246,112 @@ cleanup:
 }
 
 enum status
-data_prepare_error_buf(const struct response *res, struct buffer *buf,
-                   size_t *progress)
+data_prepare_dirlisting_buf(const struct response *res, int filefd,
+                            struct buffer *buf, size_t *progress)
+{
+	size_t len;
+
+	/* unused */
+	(void)filefd;
+
+	/* top up the buffer */
+	buffer_compact(buf);
+
+	/* copy the next slice of the rendered listing */
+	len = MIN(buf->size - buf->len,
+	          res->file.upper - res->file.lower + 1 - *progress);
+	memcpy(buf->data + buf->len, res->listing + res->file.lower + *progress,
+	       len);
+	buf->len += len;
+	*progress += len;
+
+	return 0;
+}
+
+enum status
+data_stream_dirlisting(const struct response *res, int dirfd,
+                       struct buffer *buf, size_t *progress, off_t *cookie)
 {
-	/* reset buffer */
-	memset(buf, 0, sizeof(*buf));
+	#ifdef __linux__
+		struct linux_dirent64 *d;
+		uint64_t dents[BUFFER_SIZE / sizeof(uint64_t)];
+		ssize_t n, i;
+		size_t len;
+
+		/* top up the buffer */
+		buffer_compact(buf);
+		len = buf->len;
+
+		/*
+		 * stream the entries in directory order, continuing after
+		 * the last one sent (a negative cookie marks the end)
+		 */
+		if (*cookie < 0) {
+			return 0;
+		}
+		if (*progress == 0 && append_listing_header(res, buf)) {
+			/* try again once the buffer has been sent */
+			return (buf->len > 0) ? 0 : S_REQUEST_TOO_LARGE;
+		}
+		if (lseek(dirfd, *cookie, SEEK_SET) < 0) {
+			return S_INTERNAL_SERVER_ERROR;
+		}
+		for (;;) {
+			if ((n = syscall(SYS_getdents64, dirfd, dents,
+			                 sizeof(dents))) < 0) {
+				return S_INTERNAL_SERVER_ERROR;
+			} else if (n == 0) {
+				if (!append_listing_footer(buf)) {
+					*cookie = -1;
+				}
+				break;
+			}
+			for (i = 0; i < n; i += d->d_reclen) {
+				d = (struct linux_dirent64 *)((char *)dents + i);
+
+				/* skip hidden files, "." and ".." */
+				if (d->d_name[0] != '.' &&
+				    append_listing_entry(d->d_name, d->d_type,
+				                         buf)) {
+					/* buffer full */
+					goto done;
+				}
+				*cookie = d->d_off;
+			}
+		}
+	done:
+		*progress += buf->len - len;
+
+		return 0;
+	#else
+		/* listings are never streamed without getdents64() */
+		(void)res;
+		(void)dirfd;
+		(void)buf;
+		(void)progress;
+		(void)cookie;
+
+		return S_INTERNAL_SERVER_ERROR;
+	#endif
+}
+
+enum status
+data_prepare_error_buf(const struct response *res, int filefd,
+                       struct buffer *buf, size_t *progress)
+{
+	/* unused */
+	(void)filefd;
+
+	/* top up the buffer */
+	buffer_compact(buf);
 
 	if (*progress == 0) {
 		/* write error body */
-		if (buffer_appendf(buf,
-		                   "<!DOCTYPE html>\n<html>\n\t<head>\n"
-		                   "\t\t<title>%d %s</title>\n\t</head>\n"
-		                   "\t<body>\n\t\t<h1>%d %s</h1>\n"
-		                   "\t</body>\n</html>\n",
+		if (buffer_appendf(buf, error_body_fmt,
 		                   res->status, status_str[res->status],
-			           res->status, status_str[res->status])) {
-			return S_INTERNAL_SERVER_ERROR;
+		                   res->status, status_str[res->status])) {
+			/* try again once the buffer has been sent */
+			return (buf->len > 0) ? 0 : S_INTERNAL_SERVER_ERROR;
 		}
 		(*progress)++;
 	}
@@ -185,47 +360,102 @@ data_prepare_error_buf(const struct response *res, struct buffer *buf,
 }
 
 enum status
-data_prepare_file_buf(const struct response *res, struct buffer *buf,
-                  size_t *progress)
+data_prepare_cached_buf(const struct response *res, int filefd,
+                        struct buffer *buf, size_t *progress)
 {
-	FILE *fp;
-	enum status s = 0;
-	ssize_t r;
-	size_t remaining;
+	size_t len;
 
-	/* reset buffer */
-	memset(buf, 0, sizeof(*buf));
+	/* unused */
+	(void)filefd;
 
-	/* open file */
-	if (!(fp = fopen(res->internal_path, "r"))) {
-		s = S_FORBIDDEN;
-		goto cleanup;
-	}
+	/* top up the buffer */
+	buffer_compact(buf);
 
-	/* seek to lower bound + progress */
-	if (fseek(fp, res->file.lower + *progress, SEEK_SET)) {
-		s = S_INTERNAL_SERVER_ERROR;
-		goto cleanup;
-	}
+	/* copy data straight from the cache, file.lower is the arena offset */
+	len = MIN(buf->size - buf->len,
+	          res->file.upper - res->file.lower + 1 - *progress);
+	memcpy(buf->data + buf->len, cache_data(res->file.lower + *progress),
+	       len);
+	buf->len += len;
+	*progress += len;
+
+	return 0;
+}
 
-	/* read data into buf */
+enum status
+data_prepare_file_buf(const struct response *res, int filefd,
+                      struct buffer *buf, size_t *progress)
+{
+	ssize_t r;
+	size_t remaining;
+
+	/* top up the buffer */
+	buffer_compact(buf);
+
+	/* read data into the free space, starting at lower bound + progress */
 	remaining = res->file.upper - res->file.lower + 1 - *progress;
-	while ((r = fread(buf->data + buf->len, 1,
-	                  MIN(sizeof(buf->data) - buf->len,
-			  remaining), fp))) {
-		if (r < 0) {
-			s = S_INTERNAL_SERVER_ERROR;
-			goto cleanup;
+	while (remaining > 0 && buf->len < buf->size) {
+		if ((r = pread(filefd, buf->data + buf->len,
+		               MIN(buf->size - buf->len, remaining),
+		               res->file.lower + *progress)) < 0) {
+			return S_INTERNAL_SERVER_ERROR;
+		} else if (r == 0) {
+			/*
+			 * the file has been truncated under us; we can't
+			 * deliver the announced length, so the connection
+			 * must not be reused
+			 */
+			return S_INTERNAL_SERVER_ERROR;
 		}
 		buf->len += r;
 		*progress += r;
 		remaining -= r;
 	}
 
-cleanup:
-	if (fp) {
-		fclose(fp);
-	}
+	return 0;
+}
 
-	return s;
+enum status
+data_send_file(int fd, const struct response *res, int filefd,
+               struct buffer *buf, size_t *progress)
+{
+	#ifdef __linux__
+		off_t off;
+		ssize_t r;
+		size_t remaining;
+
+		/*
+		 * let the kernel copy the range straight from the page
+		 * cache to the socket until it is drained or would block
+		 */
+		remaining = res->file.upper - res->file.lower + 1 - *progress;
+		off = res->file.lower + *progress;
+		while (remaining > 0) {
+			if ((r = sendfile(fd, filefd, &off, remaining)) < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					/* socket is full, try again later */
+					break;
+				} else if (errno == EINVAL || errno == ENOSYS) {
+					/*
+					 * the file system doesn't support
+					 * sendfile(), fall back to the buffer
+					 */
+					return data_fct[res->type](res, filefd,
+					                           buf, progress);
+				} else {
+					return S_REQUEST_TIMEOUT;
+				}
+			} else if (r == 0) {
+				/* the file has been truncated under us */
+				return S_INTERNAL_SERVER_ERROR;
+			}
+			*progress += r;
+			remaining -= r;
+		}
+
+		return 0;
+	#else
+		/* no sendfile(), use the buffer */
+		return data_fct[res->type](res, filefd, buf, progress);
+	#endif
 }
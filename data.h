@@ -5,14 +5,22 @@
 #include "http.h"
 #include "util.h"
 
-extern enum status (* const data_fct[])(const struct response *,
+extern enum status (* const data_fct[])(const struct response *, int,
                                         struct buffer *, size_t *);
 
-enum status data_prepare_dirlisting_buf(const struct response *,
-                                    struct buffer *, size_t *);
-enum status data_prepare_error_buf(const struct response *,
+enum status data_render_dirlisting(const struct response *, char **,
+                                   size_t *);
+enum status data_stream_dirlisting(const struct response *, int,
+                                   struct buffer *, size_t *, off_t *);
+enum status data_prepare_dirlisting_buf(const struct response *, int,
+                                        struct buffer *, size_t *);
+enum status data_prepare_error_buf(const struct response *, int,
                                    struct buffer *, size_t *);
-enum status data_prepare_file_buf(const struct response *,
-                              struct buffer *, size_t *);
+enum status data_prepare_cached_buf(const struct response *, int,
+                                    struct buffer *, size_t *);
+enum status data_prepare_file_buf(const struct response *, int,
+                                  struct buffer *, size_t *);
+enum status data_send_file(int, const struct response *, int,
+                           struct buffer *, size_t *);
 
 #endif /* DATA_H */
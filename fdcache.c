@@ -0,0 +1,176 @@
+/* See LICENSE file for copyright and license details. */
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "fdcache.h"
+#include "util.h"
+
+/*
+ * process-wide cache of read-only file descriptors shared by all
+ * worker threads. An entry is either
+ *
+ *  - free:   path == NULL, refcount == 0 (fd is -1)
+ *  - cached: path != NULL (fd is open, refcount may be 0)
+ *  - stale:  path == NULL, refcount > 0, i.e. the file has changed
+ *            or the entry has been evicted, and the fd is closed
+ *            as soon as the last connection releases it
+ *
+ * so at most nentries fd's are held by the cache at any time. The
+ * number of entries is expected to be small, which is why a linear
+ * scan over the (precomputed) path hashes is sufficient.
+ */
+struct fdcache_entry {
+	char *path;
+	uint32_t hash;
+	int fd;
+	size_t refcount;
+	unsigned long long lastuse;
+	struct stat st;
+};
+
+static struct fdcache_entry *entry;
+static size_t nentries;
+static unsigned long long tick;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+detach(struct fdcache_entry *e)
+{
+	/* turn a cached entry into a stale or free one */
+	free(e->path);
+	e->path = NULL;
+
+	if (e->refcount == 0) {
+		close(e->fd);
+		e->fd = -1;
+	}
+}
+
+void
+fdcache_init(size_t n)
+{
+	size_t i;
+
+	if (n == 0) {
+		return;
+	}
+
+	if (!(entry = reallocarray(NULL, n, sizeof(*entry)))) {
+		die("reallocarray:");
+	}
+	for (i = 0; i < n; i++) {
+		memset(&entry[i], 0, sizeof(entry[i]));
+		entry[i].fd = -1;
+	}
+	nentries = n;
+}
+
+int
+fdcache_open(const char *path, const struct stat *st)
+{
+	struct fdcache_entry *e, *lru;
+	struct stat fst;
+	uint32_t h;
+	size_t i;
+	int fd;
+
+	if (nentries == 0) {
+		return open(path, O_RDONLY);
+	}
+	h = strhash(path);
+
+	/* look for a cached fd of this very file */
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < nentries; i++) {
+		e = &entry[i];
+
+		if (e->path == NULL || e->hash != h || strcmp(e->path, path)) {
+			continue;
+		}
+		if (same_file(&e->st, st)) {
+			e->refcount++;
+			e->lastuse = ++tick;
+			fd = e->fd;
+			pthread_mutex_unlock(&lock);
+
+			return fd;
+		}
+
+		/* the file has changed since it was cached */
+		detach(e);
+		break;
+	}
+	pthread_mutex_unlock(&lock);
+
+	/* open the file without holding the lock */
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return -1;
+	}
+	if (fstat(fd, &fst) < 0 || !same_file(&fst, st)) {
+		/*
+		 * the file has been replaced between stat() and open(),
+		 * serve it, but don't cache it
+		 */
+		return fd;
+	}
+
+	/* determine a free entry or, failing that, the LRU unused one */
+	pthread_mutex_lock(&lock);
+	for (i = 0, e = NULL, lru = NULL; i < nentries; i++) {
+		if (entry[i].path == NULL && entry[i].refcount == 0) {
+			e = &entry[i];
+			break;
+		}
+		if (entry[i].path != NULL && entry[i].refcount == 0 &&
+		    (lru == NULL || entry[i].lastuse < lru->lastuse)) {
+			lru = &entry[i];
+		}
+	}
+	if (e == NULL && lru != NULL) {
+		detach(lru);
+		e = lru;
+	}
+	if (e == NULL || !(e->path = strdup(path))) {
+		/* all entries are in use, hand out an uncached fd */
+		pthread_mutex_unlock(&lock);
+		return fd;
+	}
+	e->hash = h;
+	e->fd = fd;
+	e->refcount = 1;
+	e->lastuse = ++tick;
+	e->st = fst;
+	pthread_mutex_unlock(&lock);
+
+	return fd;
+}
+
+void
+fdcache_close(int fd)
+{
+	size_t i;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < nentries; i++) {
+		if (entry[i].fd == fd && entry[i].refcount > 0) {
+			if (--entry[i].refcount == 0 && entry[i].path == NULL) {
+				/* last user of a stale entry */
+				close(fd);
+				entry[i].fd = -1;
+			}
+			pthread_mutex_unlock(&lock);
+			return;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	/* not a cached fd */
+	close(fd);
+}
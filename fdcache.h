@@ -0,0 +1,12 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef FDCACHE_H
+#define FDCACHE_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+void fdcache_init(size_t);
+int fdcache_open(const char *, const struct stat *);
+void fdcache_close(int);
+
+#endif /* FDCACHE_H */
@@ -0,0 +1,1003 @@
+/* See LICENSE file for copyright and license details. */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "connection.h"
+#include "h2.h"
+#include "hpack.h"
+#include "http.h"
+#include "pool.h"
+#include "server.h"
+#include "util.h"
+
+#define FRAME_HEADER   9
+#define FRAME_MAX      16384 /* the largest frame we accept */
+#define WINDOW_DEFAULT 65535
+#define WINDOW_MAX     0x7fffffff
+
+/*
+ * room kept free in the output for the frames answering a received
+ * one (acknowledgements, window updates, resets and GOAWAY)
+ */
+#define RESERVE 64
+
+enum frame_type {
+	F_DATA,
+	F_HEADERS,
+	F_PRIORITY,
+	F_RST_STREAM,
+	F_SETTINGS,
+	F_PUSH_PROMISE,
+	F_PING,
+	F_GOAWAY,
+	F_WINDOW_UPDATE,
+	F_CONTINUATION,
+};
+
+enum frame_flag {
+	FL_ACK         = 0x01,
+	FL_END_STREAM  = 0x01,
+	FL_END_HEADERS = 0x04,
+	FL_PADDED      = 0x08,
+	FL_PRIORITY    = 0x20,
+};
+
+enum setting {
+	SET_HEADER_TABLE_SIZE = 1,
+	SET_ENABLE_PUSH,
+	SET_MAX_CONCURRENT_STREAMS,
+	SET_INITIAL_WINDOW_SIZE,
+	SET_MAX_FRAME_SIZE,
+	SET_MAX_HEADER_LIST_SIZE,
+};
+
+enum error {
+	E_NO_ERROR,
+	E_PROTOCOL_ERROR,
+	E_INTERNAL_ERROR,
+	E_FLOW_CONTROL_ERROR,
+	E_SETTINGS_TIMEOUT,
+	E_STREAM_CLOSED,
+	E_FRAME_SIZE_ERROR,
+	E_REFUSED_STREAM,
+	E_CANCEL,
+	E_COMPRESSION_ERROR,
+	E_CONNECT_ERROR,
+	E_ENHANCE_YOUR_CALM,
+};
+
+static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+/*
+ * a stream is served like a connection of its own, sharing the
+ * socket, with its body buffered in between
+ */
+struct h2_stream {
+	struct connection c;
+	uint32_t id;
+	int64_t window;
+};
+
+struct h2 {
+	struct h2_stream stream[H2_STREAMS_MAX];
+	size_t nstreams;
+	size_t next;
+	uint32_t lastid;
+	int64_t window;
+	int64_t initwindow;
+	size_t maxframe;
+	struct hpack hpack;
+	size_t preface;
+	unsigned char hblock[FRAME_MAX];
+	size_t hlen;
+	uint32_t hstream;
+	unsigned char in[FRAME_HEADER + FRAME_MAX];
+	size_t inoff;
+	size_t inlen;
+	int closing;
+};
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	       (uint32_t)p[2] << 8 | p[3];
+}
+
+static void
+put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void
+frame_header(char *p, size_t len, enum frame_type type, int flags,
+             uint32_t id)
+{
+	p[0] = len >> 16;
+	p[1] = len >> 8;
+	p[2] = len;
+	p[3] = type;
+	p[4] = flags;
+	put32((unsigned char *)p + 5, id);
+}
+
+static int
+frame(struct buffer *out, enum frame_type type, int flags, uint32_t id,
+      const void *payload, size_t len)
+{
+	if (out->size - out->len < FRAME_HEADER + len) {
+		return 1;
+	}
+	frame_header(out->data + out->len, len, type, flags, id);
+	if (len > 0) {
+		memcpy(out->data + out->len + FRAME_HEADER, payload, len);
+	}
+	out->len += FRAME_HEADER + len;
+
+	return 0;
+}
+
+static void
+send_settings(struct buffer *out)
+{
+	unsigned char p[6];
+
+	/* everything else is left at the protocol defaults */
+	p[0] = 0;
+	p[1] = SET_MAX_CONCURRENT_STREAMS;
+	put32(p + 2, H2_STREAMS_MAX);
+	frame(out, F_SETTINGS, 0, 0, p, sizeof(p));
+}
+
+static void
+send_window_update(struct buffer *out, uint32_t id, uint32_t inc)
+{
+	unsigned char p[4];
+
+	put32(p, inc);
+	frame(out, F_WINDOW_UPDATE, 0, id, p, sizeof(p));
+}
+
+static void
+send_rst_stream(struct buffer *out, uint32_t id, enum error e)
+{
+	unsigned char p[4];
+
+	put32(p, e);
+	frame(out, F_RST_STREAM, 0, id, p, sizeof(p));
+}
+
+static void
+send_goaway(struct h2 *h, struct buffer *out, enum error e)
+{
+	unsigned char p[8];
+
+	/*
+	 * streams up to the last one opened are still served, unless
+	 * this is an error, which closes the connection right away
+	 */
+	put32(p, h->lastid);
+	put32(p + 4, e);
+	frame(out, F_GOAWAY, 0, 0, p, sizeof(p));
+	h->closing = MAX(h->closing, (e == E_NO_ERROR) ? 1 : 2);
+}
+
+static struct h2_stream *
+stream_find(struct h2 *h, uint32_t id)
+{
+	size_t i;
+
+	for (i = 0; i < H2_STREAMS_MAX; i++) {
+		if (h->stream[i].id == id) {
+			return &h->stream[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void
+stream_end(struct h2 *h, struct h2_stream *st, int dropped)
+{
+	/* log and give back what the stream took, like a connection */
+	if (dropped && st->c.res != NULL) {
+		st->c.res->status = 0;
+	}
+	connection_log(&st->c);
+	connection_release(&st->c);
+	buffer_put(&st->c.buf);
+	memset(st, 0, sizeof(*st));
+	h->nstreams--;
+}
+
+static int
+stream_get_buf(struct h2_stream *st)
+{
+	const struct connection_pools *p = st->c.pools;
+	const struct response *res = st->c.res;
+	size_t remaining;
+
+	/* as for connections, large bodies take a large buffer */
+	if (res->type == RESTYPE_ERROR) {
+		return buffer_get(&st->c.buf, p->header);
+	}
+	if (res->type == RESTYPE_DIRLISTING && res->listing == NULL) {
+		return buffer_get(&st->c.buf, p->body);
+	}
+	remaining = res->file.upper - res->file.lower + 1 - st->c.progress;
+
+	return buffer_get(&st->c.buf, (remaining > pool_size(p->header)) ?
+	                  p->body : p->header);
+}
+
+static int
+stream_send_headers(struct buffer *out, const struct h2_stream *st)
+{
+	/* the static table entries naming the response fields */
+	static const size_t field_index[NUM_RES_FIELDS] = {
+		[RES_ACCEPT_RANGES]    = 18,
+		[RES_ALLOW]            = 22,
+		[RES_LOCATION]         = 46,
+		[RES_LAST_MODIFIED]    = 44,
+		[RES_CONTENT_LENGTH]   = 28,
+		[RES_CONTENT_RANGE]    = 30,
+		[RES_CONTENT_TYPE]     = 31,
+		[RES_CONTENT_ENCODING] = 26,
+		[RES_VARY]             = 59,
+	};
+	const struct response *res = st->c.res;
+	char status[4], tstmp[FIELD_MAX];
+	size_t i, start = out->len;
+
+	if (out->size - out->len < FRAME_HEADER) {
+		return 1;
+	}
+	out->len += FRAME_HEADER;
+
+	snprintf(status, sizeof(status), "%d", res->status);
+	if (hpack_encode(out, 8, status) ||
+	    (!timestamp(tstmp, sizeof(tstmp), time(NULL)) &&
+	     hpack_encode(out, 33, tstmp))) {
+		goto err;
+	}
+	for (i = 0; i < NUM_RES_FIELDS; i++) {
+		if (res->field[i][0] != '\0' &&
+		    hpack_encode(out, field_index[i], res->field[i])) {
+			goto err;
+		}
+	}
+	frame_header(out->data + start, out->len - start - FRAME_HEADER,
+	             F_HEADERS, FL_END_HEADERS |
+	             (connection_has_body(&st->c) ? 0 : FL_END_STREAM),
+	             st->id);
+
+	return 0;
+err:
+	out->len = start;
+	return 1;
+}
+
+static int
+stream_send(struct connection *c, struct h2_stream *st)
+{
+	struct h2 *h = c->h2;
+	struct buffer *out = &c->buf, *b = &st->c.buf;
+	enum status s;
+	size_t n;
+	int flags;
+
+	if (st->c.state == C_SEND_HEADER) {
+		if (stream_send_headers(out, st)) {
+			return 0;
+		}
+		if (!connection_has_body(&st->c)) {
+			stream_end(h, st, 0);
+			return 1;
+		}
+		st->c.state = C_SEND_BODY;
+		return 1;
+	}
+
+	/* top up the buffer with body data once it has been sent */
+	if (b->off == b->len) {
+		if (b->data == NULL && stream_get_buf(st)) {
+			s = S_INTERNAL_SERVER_ERROR;
+			goto err;
+		}
+		if ((s = connection_fill_body_buf(&st->c))) {
+			goto err;
+		}
+	}
+
+	/* send as much as the room and both flow control windows allow */
+	n = MIN(b->len - b->off, MIN(out->size - out->len - RESERVE -
+	                             FRAME_HEADER, h->maxframe));
+	if (n > 0) {
+		if (h->window <= 0 || st->window <= 0) {
+			return 0;
+		}
+		n = MIN(n, (size_t)MIN(h->window, st->window));
+	}
+
+	/* a fill that comes up empty ends the body as well */
+	flags = (n == b->len - b->off &&
+	         (n == 0 || connection_body_done(&st->c))) ? FL_END_STREAM : 0;
+	frame(out, F_DATA, flags, st->id, b->data + b->off, n);
+	b->off += n;
+	h->window -= n;
+	st->window -= n;
+	if (flags & FL_END_STREAM) {
+		stream_end(h, st, 0);
+	}
+
+	return 1;
+err:
+	/* too late to do any real error handling */
+	st->c.res->status = s;
+	send_rst_stream(out, st->id, E_INTERNAL_ERROR);
+	stream_end(h, st, 0);
+	return 1;
+}
+
+static int
+decode_request(struct h2 *h, struct request *req)
+{
+	enum hpack_field f;
+	enum status s = 0;
+	size_t i, nlen, vlen;
+	int method = 0, path = 0;
+	char name[HPACK_STRING_MAX + 1], value[HPACK_STRING_MAX + 1];
+	const unsigned char *p = h->hblock, *end = h->hblock + h->hlen;
+
+	/*
+	 * the whole header block is always decoded to keep the table
+	 * in sync, even once the request has failed or if there is no
+	 * request to fill in. A negative return value means that
+	 * the block was corrupt
+	 */
+	while ((f = hpack_decode(&h->hpack, &p, end, name, &nlen, value,
+	                         &vlen)) != HPACK_END) {
+		if (f == HPACK_ERROR) {
+			return -1;
+		}
+		if (req == NULL || s) {
+			continue;
+		}
+		if (f == HPACK_TOO_LARGE) {
+			s = S_REQUEST_TOO_LARGE;
+		} else if (!strcmp(name, ":method")) {
+			for (i = 0; i < NUM_REQ_METHODS; i++) {
+				if (!strcmp(value, req_method_str[i])) {
+					break;
+				}
+			}
+			if (i == NUM_REQ_METHODS) {
+				s = S_METHOD_NOT_ALLOWED;
+			} else {
+				req->method = i;
+				method = 1;
+			}
+		} else if (!strcmp(name, ":path")) {
+			s = http_parse_target(value, vlen, req);
+			path = 1;
+		} else if (!strcmp(name, ":authority") ||
+		           !strcmp(name, "host")) {
+			if (vlen >= FIELD_MAX) {
+				s = S_REQUEST_TOO_LARGE;
+			} else {
+				memcpy(req->field[REQ_HOST], value, vlen + 1);
+			}
+		} else if (name[0] != ':') {
+			for (i = 0; i < NUM_REQ_FIELDS; i++) {
+				if (!strcasecmp(name, req_field_str[i])) {
+					break;
+				}
+			}
+			if (i == NUM_REQ_FIELDS) {
+				continue;
+			}
+			if (vlen >= FIELD_MAX) {
+				s = S_REQUEST_TOO_LARGE;
+			} else {
+				memcpy(req->field[i], value, vlen + 1);
+			}
+		}
+	}
+	if (req == NULL || s) {
+		return s;
+	}
+	if (!method || !path) {
+		return S_BAD_REQUEST;
+	}
+
+	return http_parse_host(req);
+}
+
+static void
+stream_begin(struct connection *c, const struct server *srv, uint32_t id)
+{
+	struct h2 *h = c->h2;
+	struct h2_stream *st;
+	int s;
+
+	if (id <= h->lastid || h->closing) {
+		/*
+		 * trailers or a stream opened after GOAWAY, which are
+		 * ignored once the table has been kept in sync
+		 */
+		if (decode_request(h, NULL) < 0) {
+			send_goaway(h, &c->buf, E_COMPRESSION_ERROR);
+		}
+		return;
+	}
+	h->lastid = id;
+
+	/* take a free stream, which takes request and response state */
+	if ((st = stream_find(h, 0)) != NULL) {
+		st->c.pools = c->pools;
+		st->c.ia = c->ia;
+		if (connection_attach(&st->c)) {
+			connection_release(&st->c);
+			memset(st, 0, sizeof(*st));
+			st = NULL;
+		}
+	}
+	if ((s = decode_request(h, (st != NULL) ? st->c.req : NULL)) < 0) {
+		if (st != NULL) {
+			connection_release(&st->c);
+			memset(st, 0, sizeof(*st));
+		}
+		send_goaway(h, &c->buf, E_COMPRESSION_ERROR);
+		return;
+	}
+	if (st == NULL) {
+		send_rst_stream(&c->buf, id, E_REFUSED_STREAM);
+		return;
+	}
+	st->id = id;
+	st->window = h->initwindow;
+	st->c.state = C_SEND_HEADER;
+	h->nstreams++;
+
+	if (s) {
+		http_prepare_error_response(st->c.req, st->c.res, s);
+	} else {
+		connection_prepare_response(&st->c, srv);
+	}
+
+	/* as on HTTP/1 connections, serve a limited number of requests */
+	if (++c->nrequests >= srv->maxrequests) {
+		send_goaway(h, &c->buf, E_NO_ERROR);
+	}
+}
+
+static enum error
+apply_settings(struct h2 *h, const unsigned char *p, size_t len)
+{
+	size_t i, j;
+	uint32_t v;
+
+	if (len % 6) {
+		return E_FRAME_SIZE_ERROR;
+	}
+	for (i = 0; i < len; i += 6) {
+		v = get32(p + i + 2);
+
+		switch (p[i] << 8 | p[i + 1]) {
+		case SET_ENABLE_PUSH:
+			/* we never push */
+			if (v > 1) {
+				return E_PROTOCOL_ERROR;
+			}
+			break;
+		case SET_INITIAL_WINDOW_SIZE:
+			if (v > WINDOW_MAX) {
+				return E_FLOW_CONTROL_ERROR;
+			}
+			/* no stream window may be pushed beyond the limit */
+			for (j = 0; j < H2_STREAMS_MAX; j++) {
+				if (h->stream[j].id == 0) {
+					continue;
+				}
+				h->stream[j].window += (int64_t)v -
+				                       h->initwindow;
+				if (h->stream[j].window > WINDOW_MAX) {
+					return E_FLOW_CONTROL_ERROR;
+				}
+			}
+			h->initwindow = v;
+			break;
+		case SET_MAX_FRAME_SIZE:
+			if (v < FRAME_MAX || v > 0xffffff) {
+				return E_PROTOCOL_ERROR;
+			}
+			h->maxframe = v;
+			break;
+		default:
+			/* unknown or of no concern to us */
+			break;
+		}
+	}
+
+	return E_NO_ERROR;
+}
+
+static int
+h2_frame(struct connection *c, const struct server *srv)
+{
+	struct h2 *h = c->h2;
+	struct h2_stream *st;
+	const unsigned char *f = h->in + h->inoff, *p;
+	enum error e = E_PROTOCOL_ERROR;
+	size_t len, pad, avail = h->inlen - h->inoff;
+	uint32_t id, v;
+	int type, flags;
+
+	/* the client preface comes first */
+	if (h->preface < sizeof(preface) - 1) {
+		len = MIN(avail, sizeof(preface) - 1 - h->preface);
+		if (len == 0) {
+			return 0;
+		}
+		if (memcmp(f, preface + h->preface, len)) {
+			/* not an HTTP/2 client after all */
+			h->closing = 2;
+			return 0;
+		}
+		h->preface += len;
+		h->inoff += len;
+		return 1;
+	}
+
+	/* wait for a complete frame */
+	if (avail < FRAME_HEADER) {
+		return 0;
+	}
+	len = (size_t)f[0] << 16 | (size_t)f[1] << 8 | f[2];
+	type = f[3];
+	flags = f[4];
+	id = get32(f + 5) & 0x7fffffff;
+	if (len > FRAME_MAX) {
+		e = E_FRAME_SIZE_ERROR;
+		goto err;
+	}
+	if (avail < FRAME_HEADER + len) {
+		return 0;
+	}
+	h->inoff += FRAME_HEADER + len;
+	p = f + FRAME_HEADER;
+
+	/* a header block is continued without interruption */
+	if (h->hstream != 0 && (type != F_CONTINUATION || id != h->hstream)) {
+		goto err;
+	}
+
+	switch (type) {
+	case F_DATA:
+		if (id == 0 || id > h->lastid) {
+			goto err;
+		}
+
+		/* request bodies are discarded, returning the window */
+		if (len > 0) {
+			send_window_update(&c->buf, 0, len);
+		}
+		break;
+	case F_HEADERS:
+		if (id == 0 || !(id & 1)) {
+			goto err;
+		}
+		pad = 0;
+		if (flags & FL_PADDED) {
+			if (len < 1) {
+				goto err;
+			}
+			pad = *p++;
+			len--;
+		}
+		if (flags & FL_PRIORITY) {
+			/* we don't prioritize */
+			if (len < 5) {
+				goto err;
+			}
+			p += 5;
+			len -= 5;
+		}
+		if (pad > len) {
+			goto err;
+		}
+		len -= pad;
+		h->hlen = 0;
+		/* fallthrough */
+	case F_CONTINUATION:
+		if (type == F_CONTINUATION && h->hstream == 0) {
+			goto err;
+		}
+		if (len > sizeof(h->hblock) - h->hlen) {
+			e = E_ENHANCE_YOUR_CALM;
+			goto err;
+		}
+		memcpy(h->hblock + h->hlen, p, len);
+		h->hlen += len;
+		if (flags & FL_END_HEADERS) {
+			h->hstream = 0;
+			stream_begin(c, srv, id);
+		} else {
+			h->hstream = id;
+		}
+		break;
+	case F_PRIORITY:
+		if (id == 0) {
+			goto err;
+		}
+		if (len != 5) {
+			e = E_FRAME_SIZE_ERROR;
+			goto err;
+		}
+		break;
+	case F_RST_STREAM:
+		if (id == 0 || id > h->lastid) {
+			goto err;
+		}
+		if (len != 4) {
+			e = E_FRAME_SIZE_ERROR;
+			goto err;
+		}
+		if ((st = stream_find(h, id)) != NULL) {
+			/* cancelled by the client */
+			stream_end(h, st, 1);
+		}
+		break;
+	case F_SETTINGS:
+		if (id != 0) {
+			goto err;
+		}
+		if (flags & FL_ACK) {
+			if (len != 0) {
+				e = E_FRAME_SIZE_ERROR;
+				goto err;
+			}
+			break;
+		}
+		if ((e = apply_settings(h, p, len))) {
+			goto err;
+		}
+		frame(&c->buf, F_SETTINGS, FL_ACK, 0, NULL, 0);
+		break;
+	case F_PING:
+		if (id != 0) {
+			goto err;
+		}
+		if (len != 8) {
+			e = E_FRAME_SIZE_ERROR;
+			goto err;
+		}
+		if (!(flags & FL_ACK)) {
+			frame(&c->buf, F_PING, FL_ACK, 0, p, len);
+		}
+		break;
+	case F_GOAWAY:
+		if (id != 0) {
+			goto err;
+		}
+
+		/* finish the streams we have, but take no new ones */
+		h->closing = MAX(h->closing, 1);
+		break;
+	case F_WINDOW_UPDATE:
+		if (len != 4) {
+			e = E_FRAME_SIZE_ERROR;
+			goto err;
+		}
+		v = get32(p) & 0x7fffffff;
+		if (id == 0) {
+			if (v == 0) {
+				goto err;
+			}
+			if (h->window + v > WINDOW_MAX) {
+				e = E_FLOW_CONTROL_ERROR;
+				goto err;
+			}
+			h->window += v;
+		} else if ((st = stream_find(h, id)) != NULL) {
+			if (v == 0 || st->window + v > WINDOW_MAX) {
+				send_rst_stream(&c->buf, id, (v == 0) ?
+				                E_PROTOCOL_ERROR :
+				                E_FLOW_CONTROL_ERROR);
+				stream_end(h, st, 1);
+			} else {
+				st->window += v;
+			}
+		} else if (id > h->lastid) {
+			goto err;
+		}
+		break;
+	case F_PUSH_PROMISE:
+		/* clients don't push */
+		goto err;
+	default:
+		/* unknown frames are ignored */
+		break;
+	}
+
+	return 1;
+err:
+	send_goaway(h, &c->buf, e);
+	return 0;
+}
+
+static int
+h2_produce(struct connection *c)
+{
+	struct h2 *h = c->h2;
+	size_t i, n;
+	int progress = 0, sent;
+
+	/*
+	 * let the streams take turns, one frame each, so they share
+	 * the connection, until the output is full or all of them are
+	 * waiting for the client
+	 */
+	do {
+		sent = 0;
+		for (n = 0; n < H2_STREAMS_MAX; n++) {
+			if (c->buf.size - c->buf.len <= RESERVE + FRAME_HEADER) {
+				return progress;
+			}
+			i = h->next;
+			h->next = (h->next + 1) % H2_STREAMS_MAX;
+			if (h->stream[i].id != 0 &&
+			    stream_send(c, &h->stream[i])) {
+				sent = progress = 1;
+			}
+		}
+	} while (sent);
+
+	return progress;
+}
+
+void
+h2_serve(struct connection *c, const struct server *srv, const char *data,
+         size_t len)
+{
+	struct h2 *h = c->h2;
+	ssize_t r;
+	size_t n;
+	int progress, reading;
+
+	/*
+	 * take what the event queue has received for us or, if it has
+	 * left that to us, read it ourselves
+	 */
+	reading = (data == NULL && c->state == C_RECV_HEADER);
+
+	do {
+		progress = 0;
+
+		if (h->inoff > 0) {
+			memmove(h->in, h->in + h->inoff, h->inlen - h->inoff);
+			h->inlen -= h->inoff;
+			h->inoff = 0;
+		}
+		n = sizeof(h->in) - h->inlen;
+		if (len > 0) {
+			n = MIN(n, len);
+			memcpy(h->in + h->inlen, data, n);
+			h->inlen += n;
+			data += n;
+			len -= n;
+			progress = (n > 0);
+		} else if (reading && n > 0) {
+			if ((r = read(c->fd, h->in + h->inlen, n)) < 0 &&
+			    (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				reading = 0;
+			} else if (r <= 0) {
+				/* the client has gone */
+				goto close;
+			} else {
+				h->inlen += r;
+				progress = 1;
+			}
+		}
+
+		/* handle frames as long as we can answer them */
+		buffer_compact(&c->buf);
+		while (h->closing < 2 && c->buf.size - c->buf.len >= RESERVE &&
+		       h2_frame(c, srv)) {
+			progress = 1;
+		}
+		/*
+		 * respond once the client has confirmed the protocol, which,
+		 * after an upgrade, also keeps the response apart from the
+		 * 101 response in front of it
+		 */
+		if (h->closing < 2 && h->preface == sizeof(preface) - 1 &&
+		    h2_produce(c)) {
+			progress = 1;
+		}
+
+		if (http_send_buf(c->fd, &c->buf)) {
+			goto close;
+		}
+		if (c->buf.len > 0) {
+			/* not done yet */
+			break;
+		}
+	} while (progress);
+
+	if (len > 0) {
+		/* the client keeps sending while it doesn't receive */
+		goto close;
+	}
+	if (c->buf.len > 0) {
+		c->state = C_SEND_BODY;
+		return;
+	}
+	if (h->closing == 2 || (h->closing == 1 && h->nstreams == 0)) {
+		goto close;
+	}
+	c->state = C_RECV_HEADER;
+	return;
+close:
+	/* streams still active are logged as dropped */
+	connection_reset(c);
+}
+
+static struct h2 *
+h2_create(struct connection *c)
+{
+	struct h2 *h;
+
+	if (!(h = calloc(1, sizeof(*h)))) {
+		warn("calloc:");
+		return NULL;
+	}
+	hpack_init(&h->hpack);
+	h->window = h->initwindow = WINDOW_DEFAULT;
+	h->maxframe = FRAME_MAX;
+
+	/* frames are collected in a large buffer */
+	if (buffer_get(&c->buf, c->pools->body)) {
+		free(h);
+		return NULL;
+	}
+
+	return h;
+}
+
+static void
+h2_take_input(struct connection *c, struct h2 *h)
+{
+	size_t n = MIN(c->in.len - c->in.off, sizeof(h->in));
+
+	/* what has been received behind the switch is HTTP/2 already */
+	if (n > 0) {
+		memcpy(h->in, c->in.data + c->in.off, n);
+	}
+	h->inlen = n;
+	buffer_put(&c->in);
+	c->h2 = h;
+}
+
+int
+h2_start(struct connection *c, size_t hlen)
+{
+	struct h2 *h;
+
+	/*
+	 * the client preface starts out like an HTTP/1 header, which
+	 * has been received already
+	 */
+	if (!(h = h2_create(c))) {
+		return 1;
+	}
+	h->preface = hlen;
+	c->in.off += hlen;
+	send_settings(&c->buf);
+	h2_take_input(c, h);
+
+	return 0;
+}
+
+static int
+base64url_decode(const char *s, unsigned char *out, size_t *len)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	                               "abcdefghijklmnopqrstuvwxyz"
+	                               "0123456789-_";
+	const char *c;
+	uint32_t acc = 0;
+	int bits = 0;
+
+	for (*len = 0; *s != '\0' && *s != '='; s++) {
+		if (!(c = strchr(alphabet, *s))) {
+			return 1;
+		}
+		acc = (acc << 6) | (c - alphabet);
+		if ((bits += 6) >= 8) {
+			bits -= 8;
+			out[(*len)++] = acc >> bits;
+		}
+	}
+
+	return 0;
+}
+
+int
+h2_upgrade(struct connection *c, const struct server *srv)
+{
+	struct h2 *h;
+	struct h2_stream *st;
+	size_t len;
+	unsigned char settings[FIELD_MAX];
+
+	/* the client's settings come with the request */
+	if (base64url_decode(c->req->field[REQ_HTTP2_SETTINGS], settings,
+	                     &len) || !(h = h2_create(c))) {
+		return 1;
+	}
+	if (apply_settings(h, settings, len) ||
+	    buffer_appendf(&c->buf, "HTTP/1.1 101 Switching Protocols\r\n"
+	                   "Connection: Upgrade\r\n"
+	                   "Upgrade: h2c\r\n\r\n")) {
+		buffer_put(&c->buf);
+		free(h);
+		return 1;
+	}
+	send_settings(&c->buf);
+
+	/* the request is answered on stream 1, as its first response */
+	st = &h->stream[0];
+	st->c.pools = c->pools;
+	st->c.ia = c->ia;
+	st->c.req = c->req;
+	st->c.res = c->res;
+	st->c.state = C_SEND_HEADER;
+	st->id = h->lastid = 1;
+	st->window = h->initwindow;
+	h->nstreams = 1;
+	c->req = NULL;
+	c->res = NULL;
+	connection_prepare_response(&st->c, srv);
+	if (++c->nrequests >= srv->maxrequests) {
+		send_goaway(h, &c->buf, E_NO_ERROR);
+	}
+
+	/* the client preface follows in full */
+	h->preface = 0;
+	h2_take_input(c, h);
+
+	return 0;
+}
+
+int
+h2_busy(const struct connection *c)
+{
+	/* whether streams are waiting to be served */
+	return c->h2->nstreams > 0;
+}
+
+void
+h2_free(struct connection *c)
+{
+	struct h2 *h = c->h2;
+	size_t i;
+
+	for (i = 0; i < H2_STREAMS_MAX; i++) {
+		if (h->stream[i].id != 0) {
+			stream_end(h, &h->stream[i], 1);
+		}
+	}
+	free(h);
+	c->h2 = NULL;
+}
@@ -0,0 +1,17 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef H2_H
+#define H2_H
+
+#include <stddef.h>
+
+#include "connection.h"
+#include "server.h"
+
+int h2_start(struct connection *, size_t);
+int h2_upgrade(struct connection *, const struct server *);
+void h2_serve(struct connection *, const struct server *, const char *,
+              size_t);
+int h2_busy(const struct connection *);
+void h2_free(struct connection *);
+
+#endif /* H2_H */
@@ -0,0 +1,412 @@
+/* See LICENSE file for copyright and license details. */
+#include <stddef.h>
+#include <string.h>
+
+#include "hpack.h"
+#include "util.h"
+
+/* RFC 7541, Appendix A */
+static const struct {
+	char *name;
+	char *value;
+} static_table[] = {
+	{ ":authority",                  ""              },
+	{ ":method",                     "GET"           },
+	{ ":method",                     "POST"          },
+	{ ":path",                       "/"             },
+	{ ":path",                       "/index.html"   },
+	{ ":scheme",                     "http"          },
+	{ ":scheme",                     "https"         },
+	{ ":status",                     "200"           },
+	{ ":status",                     "204"           },
+	{ ":status",                     "206"           },
+	{ ":status",                     "304"           },
+	{ ":status",                     "400"           },
+	{ ":status",                     "404"           },
+	{ ":status",                     "500"           },
+	{ "accept-charset",              ""              },
+	{ "accept-encoding",             "gzip, deflate" },
+	{ "accept-language",             ""              },
+	{ "accept-ranges",               ""              },
+	{ "accept",                      ""              },
+	{ "access-control-allow-origin", ""              },
+	{ "age",                         ""              },
+	{ "allow",                       ""              },
+	{ "authorization",               ""              },
+	{ "cache-control",               ""              },
+	{ "content-disposition",         ""              },
+	{ "content-encoding",            ""              },
+	{ "content-language",            ""              },
+	{ "content-length",              ""              },
+	{ "content-location",            ""              },
+	{ "content-range",               ""              },
+	{ "content-type",                ""              },
+	{ "cookie",                      ""              },
+	{ "date",                        ""              },
+	{ "etag",                        ""              },
+	{ "expect",                      ""              },
+	{ "expires",                     ""              },
+	{ "from",                        ""              },
+	{ "host",                        ""              },
+	{ "if-match",                    ""              },
+	{ "if-modified-since",           ""              },
+	{ "if-none-match",               ""              },
+	{ "if-range",                    ""              },
+	{ "if-unmodified-since",         ""              },
+	{ "last-modified",               ""              },
+	{ "link",                        ""              },
+	{ "location",                    ""              },
+	{ "max-forwards",                ""              },
+	{ "proxy-authenticate",          ""              },
+	{ "proxy-authorization",         ""              },
+	{ "range",                       ""              },
+	{ "referer",                     ""              },
+	{ "refresh",                     ""              },
+	{ "retry-after",                 ""              },
+	{ "server",                      ""              },
+	{ "set-cookie",                  ""              },
+	{ "strict-transport-security",   ""              },
+	{ "transfer-encoding",           ""              },
+	{ "user-agent",                  ""              },
+	{ "vary",                        ""              },
+	{ "via",                         ""              },
+	{ "www-authenticate",            ""              },
+};
+
+/*
+ * the Huffman code of RFC 7541, Appendix B, is canonical, so it is
+ * given by the number of codes of each length and the symbols ordered
+ * by code
+ */
+static const unsigned char huffman_count[31] = {
+	0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+	0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+
+static const unsigned short huffman_symbol[257] = {
+	48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46,
+	47, 51, 52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103,
+	104, 108, 109, 110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71,
+	72, 73, 74, 75, 76, 77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87,
+	89, 106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59, 88,
+	90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62, 0, 36, 64, 91, 93,
+	126, 94, 125, 60, 96, 123, 92, 195, 208, 128, 130, 131, 162,
+	184, 194, 224, 226, 153, 161, 167, 172, 176, 177, 179, 209,
+	216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154,
+	156, 160, 163, 164, 169, 170, 173, 178, 181, 185, 186, 187,
+	189, 190, 196, 198, 228, 232, 233, 1, 135, 137, 138, 139, 140,
+	141, 143, 147, 149, 150, 151, 152, 155, 157, 158, 165, 166,
+	168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+	144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207,
+	234, 235, 192, 193, 200, 201, 202, 205, 210, 213, 218, 219,
+	238, 240, 242, 243, 255, 203, 204, 211, 212, 214, 221, 222,
+	223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254, 2,
+	3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20, 21, 23,
+	24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22, 256,
+};
+
+#define STATIC_ENTRIES LEN(static_table)
+#define ENTRY_OVERHEAD 32
+
+void
+hpack_init(struct hpack *h)
+{
+	h->nentries = 0;
+	h->size = 0;
+	h->max = HPACK_TABLE_SIZE;
+}
+
+static void
+table_evict(struct hpack *h, size_t max)
+{
+	while (h->size > max) {
+		h->nentries--;
+		h->size -= h->entry[h->nentries].nlen +
+		           h->entry[h->nentries].vlen + ENTRY_OVERHEAD;
+	}
+}
+
+static void
+table_insert(struct hpack *h, const char *name, size_t nlen,
+             const char *value, size_t vlen)
+{
+	size_t i, len = nlen + vlen;
+
+	if (len + ENTRY_OVERHEAD > h->max) {
+		/* an entry larger than the table empties it */
+		table_evict(h, 0);
+		return;
+	}
+	table_evict(h, h->max - (len + ENTRY_OVERHEAD));
+
+	/* the newest entry comes first */
+	memmove(h->data + len, h->data, h->size -
+	        h->nentries * ENTRY_OVERHEAD);
+	memcpy(h->data, name, nlen);
+	memcpy(h->data + nlen, value, vlen);
+	for (i = h->nentries; i > 0; i--) {
+		h->entry[i] = h->entry[i - 1];
+	}
+	h->entry[0].nlen = nlen;
+	h->entry[0].vlen = vlen;
+	h->nentries++;
+	h->size += len + ENTRY_OVERHEAD;
+}
+
+/* copy the name and, if value is not NULL, the value of an entry */
+static int
+table_get(const struct hpack *h, size_t index, char *name, size_t *nlen,
+          char *value, size_t *vlen)
+{
+	size_t i, off;
+
+	if (index == 0) {
+		return 1;
+	}
+	if (index <= STATIC_ENTRIES) {
+		*nlen = strlen(static_table[index - 1].name);
+		memcpy(name, static_table[index - 1].name, *nlen + 1);
+		if (value) {
+			*vlen = strlen(static_table[index - 1].value);
+			memcpy(value, static_table[index - 1].value,
+			       *vlen + 1);
+		}
+		return 0;
+	}
+	index -= STATIC_ENTRIES + 1;
+	if (index >= h->nentries) {
+		return 1;
+	}
+	for (i = 0, off = 0; i < index; i++) {
+		off += h->entry[i].nlen + h->entry[i].vlen;
+	}
+	*nlen = h->entry[index].nlen;
+	memcpy(name, h->data + off, *nlen);
+	name[*nlen] = '\0';
+	if (value) {
+		*vlen = h->entry[index].vlen;
+		memcpy(value, h->data + off + *nlen, *vlen);
+		value[*vlen] = '\0';
+	}
+	return 0;
+}
+
+/* RFC 7541, section 5.1 */
+static int
+decode_int(const unsigned char **p, const unsigned char *end, int prefix,
+           size_t *v)
+{
+	size_t max = (1 << prefix) - 1;
+	int shift;
+
+	if (*p == end) {
+		return 1;
+	}
+	if ((*v = *(*p)++ & max) < max) {
+		return 0;
+	}
+	for (shift = 0; shift <= 21; shift += 7) {
+		if (*p == end) {
+			return 1;
+		}
+		*v += (size_t)(**p & 0x7f) << shift;
+		if (!(*(*p)++ & 0x80)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static enum hpack_field
+decode_huffman(const unsigned char *s, size_t len, char *out, size_t *olen)
+{
+	long code = 0, first = 0, index = 0;
+	size_t i, n = 0;
+	int bit;
+
+	for (*olen = 0, i = 0; i < len; i++) {
+		for (bit = 7; bit >= 0; bit--) {
+			code |= (s[i] >> bit) & 1;
+			n++;
+			if (code - first < huffman_count[n]) {
+				index += code - first;
+				if (huffman_symbol[index] == 256) {
+					/* EOS must not be sent */
+					return HPACK_ERROR;
+				}
+				if (*olen == HPACK_STRING_MAX) {
+					return HPACK_TOO_LARGE;
+				}
+				out[(*olen)++] = huffman_symbol[index];
+				code = first = index = n = 0;
+				continue;
+			}
+			index += huffman_count[n];
+			first = (first + huffman_count[n]) << 1;
+			code <<= 1;
+		}
+	}
+	out[*olen] = '\0';
+
+	/* padding is the shortest prefix of EOS, i.e. all ones */
+	if (n > 7 || (code >> 1) != (1L << n) - 1) {
+		return HPACK_ERROR;
+	}
+
+	return HPACK_FIELD;
+}
+
+/* RFC 7541, section 5.2 */
+static enum hpack_field
+decode_string(const unsigned char **p, const unsigned char *end, char *out,
+              size_t *olen)
+{
+	size_t len;
+	int huffman;
+
+	if (*p == end) {
+		return HPACK_ERROR;
+	}
+	huffman = **p & 0x80;
+	if (decode_int(p, end, 7, &len) || len > (size_t)(end - *p)) {
+		return HPACK_ERROR;
+	}
+	*p += len;
+
+	if (huffman) {
+		return decode_huffman(*p - len, len, out, olen);
+	}
+	if (len > HPACK_STRING_MAX) {
+		return HPACK_TOO_LARGE;
+	}
+	memcpy(out, *p - len, len);
+	out[len] = '\0';
+	*olen = len;
+
+	return HPACK_FIELD;
+}
+
+/*
+ * decode the next field of the header block between *p and end into
+ * name and value, each HPACK_STRING_MAX + 1 bytes large. Fields too
+ * large for them are skipped, keeping the table in sync, and reported
+ * as such
+ */
+enum hpack_field
+hpack_decode(struct hpack *h, const unsigned char **p,
+             const unsigned char *end, char *name, size_t *nlen,
+             char *value, size_t *vlen)
+{
+	enum hpack_field ret;
+	size_t index;
+	int indexing;
+
+	for (;;) {
+		if (*p == end) {
+			return HPACK_END;
+		}
+		if (**p & 0x80) {
+			/* indexed field */
+			if (decode_int(p, end, 7, &index) ||
+			    table_get(h, index, name, nlen, value, vlen)) {
+				return HPACK_ERROR;
+			}
+			return HPACK_FIELD;
+		} else if ((**p & 0xe0) == 0x20) {
+			/* dynamic table size update */
+			if (decode_int(p, end, 5, &index) ||
+			    index > HPACK_TABLE_SIZE) {
+				return HPACK_ERROR;
+			}
+			h->max = index;
+			table_evict(h, h->max);
+			continue;
+		}
+		break;
+	}
+
+	/* literal field, with or without indexing */
+	indexing = (**p & 0xc0) == 0x40;
+	if (decode_int(p, end, indexing ? 6 : 4, &index)) {
+		return HPACK_ERROR;
+	}
+	if (index) {
+		if (table_get(h, index, name, nlen, NULL, NULL)) {
+			return HPACK_ERROR;
+		}
+		ret = HPACK_FIELD;
+	} else {
+		ret = decode_string(p, end, name, nlen);
+	}
+	if (ret == HPACK_ERROR) {
+		return ret;
+	}
+	if (ret == HPACK_TOO_LARGE) {
+		decode_string(p, end, value, vlen);
+		*nlen = *vlen = HPACK_STRING_MAX + 1;
+	} else if ((ret = decode_string(p, end, value, vlen)) ==
+	           HPACK_ERROR) {
+		return ret;
+	} else if (ret == HPACK_TOO_LARGE) {
+		*vlen = HPACK_STRING_MAX + 1;
+	}
+
+	if (indexing) {
+		if (ret == HPACK_TOO_LARGE) {
+			table_evict(h, 0);
+		} else {
+			table_insert(h, name, *nlen, value, *vlen);
+		}
+	}
+
+	return ret;
+}
+
+static int
+encode_int(struct buffer *buf, unsigned char flags, int prefix, size_t v)
+{
+	size_t max = (1 << prefix) - 1;
+
+	if (buf->len == buf->size) {
+		return 1;
+	}
+	if (v < max) {
+		buf->data[buf->len++] = flags | v;
+		return 0;
+	}
+	buf->data[buf->len++] = flags | max;
+	for (v -= max; v >= 0x80; v >>= 7) {
+		if (buf->len == buf->size) {
+			return 1;
+		}
+		buf->data[buf->len++] = (v & 0x7f) | 0x80;
+	}
+	if (buf->len == buf->size) {
+		return 1;
+	}
+	buf->data[buf->len++] = v;
+
+	return 0;
+}
+
+/*
+ * append the field of the static table entry index with the given
+ * value as a literal without indexing, so our side keeps no table
+ */
+int
+hpack_encode(struct buffer *buf, size_t index, const char *value)
+{
+	size_t len = buf->len, vlen = strlen(value);
+
+	if (encode_int(buf, 0x00, 4, index) ||
+	    encode_int(buf, 0x00, 7, vlen) ||
+	    vlen > buf->size - buf->len) {
+		buf->len = len;
+		return 1;
+	}
+	memcpy(buf->data + buf->len, value, vlen);
+	buf->len += vlen;
+
+	return 0;
+}
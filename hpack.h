@@ -0,0 +1,40 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+
+#include "util.h"
+
+/* the size of the dynamic table we allow, the protocol default */
+#define HPACK_TABLE_SIZE 4096
+
+/* names and values are decoded into buffers of this size (plus NUL) */
+#define HPACK_STRING_MAX 4096
+
+/* the decoding state of a connection, i.e. its dynamic table */
+struct hpack {
+	char data[HPACK_TABLE_SIZE];
+	struct {
+		unsigned short nlen;
+		unsigned short vlen;
+	} entry[HPACK_TABLE_SIZE / 32];
+	size_t nentries;
+	size_t size;
+	size_t max;
+};
+
+enum hpack_field {
+	HPACK_END,
+	HPACK_FIELD,
+	HPACK_TOO_LARGE,
+	HPACK_ERROR,
+};
+
+void hpack_init(struct hpack *);
+enum hpack_field hpack_decode(struct hpack *, const unsigned char **,
+                              const unsigned char *, char *, size_t *,
+                              char *, size_t *);
+int hpack_encode(struct buffer *, size_t, const char *);
+
+#endif /* HPACK_H */
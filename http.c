@@ -8,6 +8,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/socket.h>
@@ -24,6 +25,10 @@ const char *req_field_str[] = {
 	[REQ_HOST]              = "Host",
 	[REQ_RANGE]             = "Range",
 	[REQ_IF_MODIFIED_SINCE] = "If-Modified-Since",
+	[REQ_ACCEPT_ENCODING]   = "Accept-Encoding",
+	[REQ_CONNECTION]        = "Connection",
+	[REQ_UPGRADE]           = "Upgrade",
+	[REQ_HTTP2_SETTINGS]    = "HTTP2-Settings",
 };
 
 const char *req_method_str[] = {
@@ -44,27 +49,34 @@ const char *status_str[] = {
 	[S_RANGE_NOT_SATISFIABLE] = "Range Not Satisfiable",
 	[S_REQUEST_TOO_LARGE]     = "Request Header Fields Too Large",
 	[S_INTERNAL_SERVER_ERROR] = "Internal Server Error",
+	[S_SERVICE_UNAVAILABLE]   = "Service Unavailable",
 	[S_VERSION_NOT_SUPPORTED] = "HTTP Version not supported",
 };
 
+const char error_body_fmt[] = "<!DOCTYPE html>\n<html>\n\t<head>\n"
+                             "\t\t<title>%d %s</title>\n\t</head>\n"
+                             "\t<body>\n\t\t<h1>%d %s</h1>\n"
+                             "\t</body>\n</html>\n";
+
 const char *res_field_str[] = {
-	[RES_ACCEPT_RANGES]  = "Accept-Ranges",
-	[RES_ALLOW]          = "Allow",
-	[RES_LOCATION]       = "Location",
-	[RES_LAST_MODIFIED]  = "Last-Modified",
-	[RES_CONTENT_LENGTH] = "Content-Length",
-	[RES_CONTENT_RANGE]  = "Content-Range",
-	[RES_CONTENT_TYPE]   = "Content-Type",
+	[RES_ACCEPT_RANGES]    = "Accept-Ranges",
+	[RES_ALLOW]            = "Allow",
+	[RES_LOCATION]         = "Location",
+	[RES_LAST_MODIFIED]    = "Last-Modified",
+	[RES_CONTENT_LENGTH]   = "Content-Length",
+	[RES_CONTENT_RANGE]    = "Content-Range",
+	[RES_CONTENT_TYPE]     = "Content-Type",
+	[RES_CONTENT_ENCODING] = "Content-Encoding",
+	[RES_VARY]             = "Vary",
 };
 
 enum status
 http_prepare_header_buf(const struct response *res, struct buffer *buf)
 {
 	char tstmp[FIELD_MAX];
-	size_t i;
+	size_t i, start = buf->len;
 
-	/* reset buffer */
-	memset(buf, 0, sizeof(*buf));
+	/* append to the buffer, behind responses still to be sent */
 
 	/* generate timestamp */
 	if (timestamp(tstmp, sizeof(tstmp), time(NULL))) {
@@ -75,8 +87,9 @@ http_prepare_header_buf(const struct response *res, struct buffer *buf)
 	if (buffer_appendf(buf,
 	                   "HTTP/1.1 %d %s\r\n"
 	                   "Date: %s\r\n"
-	                   "Connection: close\r\n",
-	                   res->status, status_str[res->status], tstmp)) {
+	                   "Connection: %s\r\n",
+	                   res->status, status_str[res->status], tstmp,
+	                   res->keepalive ? "keep-alive" : "close")) {
 		goto err;
 	}
 
@@ -94,7 +107,7 @@ http_prepare_header_buf(const struct response *res, struct buffer *buf)
 
 	return 0;
 err:
-	memset(buf, 0, sizeof(*buf));
+	buf->len = start;
 	return S_INTERNAL_SERVER_ERROR;
 }
 
@@ -107,8 +120,9 @@ http_send_buf(int fd, struct buffer *buf)
 		return S_INTERNAL_SERVER_ERROR;
 	}
 
-	while (buf->len > 0) {
-		if ((r = write(fd, buf->data, buf->len)) <= 0) {
+	while (buf->off < buf->len) {
+		if ((r = write(fd, buf->data + buf->off,
+		               buf->len - buf->off)) <= 0) {
 			if (errno == EAGAIN || errno == EWOULDBLOCK) {
 				/*
 				 * socket is blocking, return normally.
@@ -121,10 +135,12 @@ http_send_buf(int fd, struct buffer *buf)
 				return S_REQUEST_TIMEOUT;
 			}
 		}
-		memmove(buf->data, buf->data + r, buf->len - r);
-		buf->len -= r;
+		buf->off += r;
 	}
 
+	/* drained, so the next fill can start at the front */
+	buf->off = buf->len = 0;
+
 	return 0;
 }
 
@@ -148,21 +164,44 @@ decode(const char src[PATH_MAX], char dest[PATH_MAX])
 	dest[i] = '\0';
 }
 
+size_t
+http_header_length(const struct buffer *buf)
+{
+	const char *p, *end = buf->data + buf->len;
+
+	/* the length of the first complete header in the buffer, if any */
+	for (p = buf->data + buf->off; (p = memchr(p, '\r', end - p)) &&
+	     end - p >= 4; p++) {
+		if (!memcmp(p, "\r\n\r\n", 4)) {
+			return p + 4 - (buf->data + buf->off);
+		}
+	}
+
+	return 0;
+}
+
 enum status
-http_recv_header(int fd, struct buffer *buf, int *done)
+http_recv_header(int fd, struct buffer *buf, size_t *hlen)
 {
 	enum status s;
 	ssize_t r;
 
-	while (1) {
+	/* the header may already be complete, e.g. pipelined */
+	buffer_compact(buf);
+	while (!(*hlen = http_header_length(buf))) {
+		/* buffer is full, but header is not terminated */
+		if (buf->len == buf->size) {
+			s = S_REQUEST_TOO_LARGE;
+			goto err;
+		}
+
 		if ((r = read(fd, buf->data + buf->len,
-		              sizeof(buf->data) - buf->len)) < 0) {
+		              buf->size - buf->len)) < 0) {
 			if (errno == EAGAIN || errno == EWOULDBLOCK) {
 				/*
 				 * socket is drained, return normally,
-				 * but set done to zero
+				 * but leave hlen at zero
 				 */
-				*done = 0;
 				return 0;
 			} else {
 				s = S_REQUEST_TIMEOUT;
@@ -178,66 +217,75 @@ http_recv_header(int fd, struct buffer *buf, int *done)
 			goto err;
 		}
 		buf->len += r;
+	}
 
-		/* check if we are done (header terminated) */
-		if (buf->len >= 4 && !memcmp(buf->data + buf->len - 4,
-		                             "\r\n\r\n", 4)) {
-			break;
-		}
+	/*
+	 * header is complete, terminate it in place of its final \r\n,
+	 * as the buffer may hold stale data or the next request
+	 */
+	buf->data[buf->off + *hlen - 2] = '\0';
+
+	return 0;
+err:
+	buf->off = buf->len = 0;
+	return s;
+}
+
+enum status
+http_append_header(struct buffer *buf, const char *data, size_t len,
+                   size_t *hlen)
+{
+	enum status s;
+
+	/* the data has been received for us, e.g. by the event queue */
+	buffer_compact(buf);
+	if (len > buf->size - buf->len) {
+		s = S_REQUEST_TOO_LARGE;
+		goto err;
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
 
-		/* buffer is full or read over, but header is not terminated */
-		if (r == 0 || buf->len == sizeof(buf->data)) {
+	if (!(*hlen = http_header_length(buf))) {
+		if (buf->len == buf->size) {
 			s = S_REQUEST_TOO_LARGE;
 			goto err;
 		}
+		return 0;
 	}
 
-	/* header is complete, remove last \r\n and set done */
-	buf->len -= 2;
-	*done = 1;
+	/* header is complete, terminate it as above */
+	buf->data[buf->off + *hlen - 2] = '\0';
 
 	return 0;
 err:
-	memset(buf, 0, sizeof(*buf));
+	buf->off = buf->len = 0;
 	return s;
 }
 
-enum status
-http_parse_header(const char *h, struct request *req)
+int
+http_has_token(const char *field, const char *token)
 {
-	struct in6_addr addr;
-	size_t i, mlen;
-	const char *p, *q, *r, *s, *t;
-	char *m, *n;
-
-	/* empty the request struct */
-	memset(req, 0, sizeof(*req));
-
-	/*
-	 * parse request line
-	 */
+	const char *p;
+	size_t len;
 
-	/* METHOD */
-	for (i = 0; i < NUM_REQ_METHODS; i++) {
-		mlen = strlen(req_method_str[i]);
-		if (!strncmp(req_method_str[i], h, mlen)) {
-			req->method = i;
-			break;
+	/* the field is a comma-separated list of tokens */
+	for (p = field; *p != '\0'; p += (*p == ',')) {
+		p += strspn(p, " \t");
+		len = strcspn(p, " \t,");
+		if (len == strlen(token) && !strncasecmp(p, token, len)) {
+			return 1;
 		}
-	}
-	if (i == NUM_REQ_METHODS) {
-		return S_METHOD_NOT_ALLOWED;
-	}
-
-	/* a single space must follow the method */
-	if (h[mlen] != ' ') {
-		return S_BAD_REQUEST;
+		p += strcspn(p, ",");
 	}
 
-	/* basis for next step */
-	p = h + mlen + 1;
+	return 0;
+}
 
-	/* RESOURCE */
+enum status
+http_parse_target(const char *p, size_t len, struct request *req)
+{
+	const char *q = p + len, *r, *s, *t;
 
 	/*
 	 * path?query#fragment
@@ -246,9 +294,6 @@ http_parse_header(const char *h, struct request *req)
 	 * p   r     s        q
 	 *
 	 */
-	if (!(q = strchr(p, ' '))) {
-		return S_BAD_REQUEST;
-	}
 
 	/* search for first '?' */
 	for (r = p; r < q; r++) {
@@ -326,6 +371,94 @@ http_parse_header(const char *h, struct request *req)
 		req->fragment[q - (s + 1)] = '\0';
 	}
 
+	return 0;
+}
+
+enum status
+http_parse_host(struct request *req)
+{
+	struct in6_addr addr;
+	char *m, *n;
+
+	m = strrchr(req->field[REQ_HOST], ':');
+	n = strrchr(req->field[REQ_HOST], ']');
+
+	/* strip port suffix but don't interfere with IPv6 bracket notation
+	 * as per RFC 2732 */
+	if (m && (!n || m > n)) {
+		/* port suffix must not be empty */
+		if (*(m + 1) == '\0') {
+			return S_BAD_REQUEST;
+		}
+		*m = '\0';
+	}
+
+	/* strip the brackets from the IPv6 notation and validate the address */
+	if (n) {
+		/* brackets must be on the outside */
+		if (req->field[REQ_HOST][0] != '[' || *(n + 1) != '\0') {
+			return S_BAD_REQUEST;
+		}
+
+		/* remove the right bracket */
+		*n = '\0';
+		m = req->field[REQ_HOST] + 1;
+
+		/* validate the contained IPv6 address */
+		if (inet_pton(AF_INET6, m, &addr) != 1) {
+			return S_BAD_REQUEST;
+		}
+
+		/* copy it into the host field */
+		memmove(req->field[REQ_HOST], m, n - m + 1);
+	}
+
+	return 0;
+}
+
+enum status
+http_parse_header(const char *h, struct request *req)
+{
+	enum status s;
+	size_t i, mlen, flen;
+	int http11, hasbody = 0;
+	const char *p, *q;
+
+	/* empty the request struct */
+	memset(req, 0, sizeof(*req));
+
+	/*
+	 * parse request line
+	 */
+
+	/* METHOD */
+	for (i = 0; i < NUM_REQ_METHODS; i++) {
+		mlen = strlen(req_method_str[i]);
+		if (!strncmp(req_method_str[i], h, mlen)) {
+			req->method = i;
+			break;
+		}
+	}
+	if (i == NUM_REQ_METHODS) {
+		return S_METHOD_NOT_ALLOWED;
+	}
+
+	/* a single space must follow the method */
+	if (h[mlen] != ' ') {
+		return S_BAD_REQUEST;
+	}
+
+	/* basis for next step */
+	p = h + mlen + 1;
+
+	/* RESOURCE */
+	if (!(q = strchr(p, ' '))) {
+		return S_BAD_REQUEST;
+	}
+	if ((s = http_parse_target(p, q - p, req))) {
+		return s;
+	}
+
 	/* basis for next step */
 	p = q + 1;
 
@@ -338,6 +471,7 @@ http_parse_header(const char *h, struct request *req)
 	    strncmp(p, "1.1", sizeof("1.1") - 1)) {
 		return S_VERSION_NOT_SUPPORTED;
 	}
+	http11 = !strncmp(p, "1.1", sizeof("1.1") - 1);
 	p += sizeof("1.*") - 1;
 
 	/* check terminator */
@@ -355,13 +489,26 @@ http_parse_header(const char *h, struct request *req)
 	/* match field type */
 	for (; *p != '\0';) {
 		for (i = 0; i < NUM_REQ_FIELDS; i++) {
-			if (!strncasecmp(p, req_field_str[i],
-			                 strlen(req_field_str[i]))) {
+			/* the name must not just be a prefix of another */
+			flen = strlen(req_field_str[i]);
+			if (!strncasecmp(p, req_field_str[i], flen) &&
+			    (p[flen] == ':' || p[flen] == ' ' ||
+			     p[flen] == '\t')) {
 				break;
 			}
 		}
 		if (i == NUM_REQ_FIELDS) {
-			/* unmatched field, skip this line */
+			/*
+			 * unmatched field, skip this line. A request body
+			 * would be mistaken for the next request, so the
+			 * connection must not be kept alive after it
+			 */
+			if (!strncasecmp(p, "Content-Length:",
+			                 sizeof("Content-Length:") - 1) ||
+			    !strncasecmp(p, "Transfer-Encoding:",
+			                 sizeof("Transfer-Encoding:") - 1)) {
+				hasbody = 1;
+			}
 			if (!(q = strstr(p, "\r\n"))) {
 				return S_BAD_REQUEST;
 			}
@@ -369,7 +516,7 @@ http_parse_header(const char *h, struct request *req)
 			continue;
 		}
 
-		p += strlen(req_field_str[i]);
+		p += flen;
 
 		/* a single colon must follow the field name */
 		if (*p != ':') {
@@ -397,39 +544,19 @@ http_parse_header(const char *h, struct request *req)
 	/*
 	 * clean up host
 	 */
-
-	m = strrchr(req->field[REQ_HOST], ':');
-	n = strrchr(req->field[REQ_HOST], ']');
-
-	/* strip port suffix but don't interfere with IPv6 bracket notation
-	 * as per RFC 2732 */
-	if (m && (!n || m > n)) {
-		/* port suffix must not be empty */
-		if (*(m + 1) == '\0') {
-			return S_BAD_REQUEST;
-		}
-		*m = '\0';
+	if ((s = http_parse_host(req))) {
+		return s;
 	}
 
-	/* strip the brackets from the IPv6 notation and validate the address */
-	if (n) {
-		/* brackets must be on the outside */
-		if (req->field[REQ_HOST][0] != '[' || *(n + 1) != '\0') {
-			return S_BAD_REQUEST;
-		}
-
-		/* remove the right bracket */
-		*n = '\0';
-		m = req->field[REQ_HOST] + 1;
-
-		/* validate the contained IPv6 address */
-		if (inet_pton(AF_INET6, m, &addr) != 1) {
-			return S_BAD_REQUEST;
-		}
-
-		/* copy it into the host field */
-		memmove(req->field[REQ_HOST], m, n - m + 1);
-	}
+	/*
+	 * HTTP/1.1 connections persist unless the client asks to close
+	 * them, HTTP/1.0 connections only if the client asks for it
+	 */
+	req->keepalive = !hasbody &&
+	                 (http11 ?
+	                  !http_has_token(req->field[REQ_CONNECTION], "close") :
+	                  http_has_token(req->field[REQ_CONNECTION],
+	                                 "keep-alive"));
 
 	return 0;
 }
@@ -715,18 +842,64 @@ parse_range(const char *str, size_t size, size_t *lower, size_t *upper)
 	return 0;
 }
 
+static int
+accepts_encoding(const char *field, const char *coding)
+{
+	const char *p, *end, *q;
+	size_t len;
+	int star = 0, acceptable;
+
+	/*
+	 * the field is a comma-separated list of codings, each with
+	 * an optional quality ("gzip;q=0.5"), where a quality of zero
+	 * means "not acceptable" and "*" matches all codings not
+	 * listed
+	 */
+	for (p = field; *p != '\0'; p = (*end == ',') ? end + 1 : end) {
+		end = p + strcspn(p, ",");
+		p += strspn(p, " \t");
+		len = strcspn(p, " \t;,");
+
+		acceptable = 1;
+		if ((q = memchr(p, ';', end - p))) {
+			q += 1 + strspn(q + 1, " \t");
+			if (!strncasecmp(q, "q=", sizeof("q=") - 1) &&
+			    strtod(q + sizeof("q=") - 1, NULL) <= 0) {
+				acceptable = 0;
+			}
+		}
+
+		if (len == strlen(coding) && !strncasecmp(p, coding, len)) {
+			return acceptable;
+		} else if (len == 1 && *p == '*') {
+			star = acceptable;
+		}
+	}
+
+	return star;
+}
+
+static int
+compressible(const char *mime)
+{
+	/* text and text-based formats */
+	return !strncmp(mime, "text/", sizeof("text/") - 1) ||
+	       strstr(mime, "xml") || strstr(mime, "json") ||
+	       strstr(mime, "javascript");
+}
+
 void
 http_prepare_response(const struct request *req, struct response *res,
                       const struct server *srv)
 {
 	enum status s, tmps;
 	struct in6_addr addr;
-	struct stat st;
+	struct stat st, cst;
 	struct tm tm = { 0 };
 	size_t i;
-	int redirect, hasport, ipv6host;
+	int redirect, hasport, ipv6host, vary;
 	static char tmppath[PATH_MAX];
-	char *p, *mime;
+	char cpath[PATH_MAX], *p, *mime;
 
 	/* empty all response fields */
 	memset(res, 0, sizeof(*res));
@@ -807,6 +980,13 @@ http_prepare_response(const struct request *req, struct response *res,
 	if (redirect) {
 		res->status = S_MOVED_PERMANENTLY;
 
+		/* there is no body */
+		if (esnprintf(res->field[RES_CONTENT_LENGTH],
+		              sizeof(res->field[RES_CONTENT_LENGTH]), "0")) {
+			s = S_INTERNAL_SERVER_ERROR;
+			goto err;
+		}
+
 		/* encode path */
 		encode(res->path, tmppath);
 
@@ -873,6 +1053,7 @@ http_prepare_response(const struct request *req, struct response *res,
 		 * exists a directory index. If not, we either make
 		 * a directory listing (if enabled) or send an error
 		 */
+		res->st = st;
 
 		/*
 		 * append docindex to internal_path temporarily
@@ -905,6 +1086,22 @@ http_prepare_response(const struct request *req, struct response *res,
 					goto err;
 				}
 
+				/*
+				 * listings may be compressed on the fly,
+				 * whichever variant this client gets
+				 */
+				if (srv->compress) {
+					res->compress = accepts_encoding(
+						req->field[REQ_ACCEPT_ENCODING],
+						"gzip");
+					if (esnprintf(res->field[RES_VARY],
+					              sizeof(res->field[RES_VARY]),
+					              "%s", "Accept-Encoding")) {
+						s = S_INTERNAL_SERVER_ERROR;
+						goto err;
+					}
+				}
+
 				return;
 			} else {
 				/* reject */
@@ -923,6 +1120,75 @@ http_prepare_response(const struct request *req, struct response *res,
 		}
 	}
 
+	/* mime (of the original, even if we serve a compressed sibling) */
+	mime = "application/octet-stream";
+	if ((p = strrchr(res->internal_path, '.'))) {
+		for (i = 0; i < LEN(mimes); i++) {
+			if (!strcmp(mimes[i].ext, p + 1)) {
+				mime = mimes[i].type;
+				break;
+			}
+		}
+	}
+
+	/*
+	 * serve the preferred precompressed sibling (e.g. "foo.css.gz"
+	 * for "foo.css") the client accepts, unless it is older than
+	 * the original. Text may also be compressed on the fly, and in
+	 * either case the resource has compressed variants, which even
+	 * a client not sending the field must let caches know about
+	 */
+	vary = srv->compress && compressible(mime) &&
+	       st.st_size >= COMPRESS_FILE_MIN &&
+	       st.st_size <= COMPRESS_FILE_MAX;
+	for (i = 0; i < LEN(encodings); i++) {
+		if ((vary && !accepts_encoding(req->field[REQ_ACCEPT_ENCODING],
+		                               encodings[i].coding)) ||
+		    esnprintf(cpath, sizeof(cpath), "%s.%s",
+		              res->internal_path, encodings[i].ext) ||
+		    stat(cpath, &cst) < 0 || !S_ISREG(cst.st_mode) ||
+		    cst.st_mtim.tv_sec < st.st_mtim.tv_sec ||
+		    (cst.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+		     cst.st_mtim.tv_nsec < st.st_mtim.tv_nsec)) {
+			continue;
+		}
+		vary = 1;
+		if (!accepts_encoding(req->field[REQ_ACCEPT_ENCODING],
+		                      encodings[i].coding)) {
+			continue;
+		}
+		memcpy(res->internal_path, cpath, sizeof(res->internal_path));
+		st = cst;
+
+		if (esnprintf(res->field[RES_CONTENT_ENCODING],
+		              sizeof(res->field[RES_CONTENT_ENCODING]),
+		              "%s", encodings[i].coding)) {
+			s = S_INTERNAL_SERVER_ERROR;
+			goto err;
+		}
+		break;
+	}
+
+	/*
+	 * otherwise, text may be compressed on the fly if the client
+	 * wants all of it
+	 */
+	if (srv->compress && res->field[RES_CONTENT_ENCODING][0] == '\0' &&
+	    req->field[REQ_RANGE][0] == '\0' && compressible(mime) &&
+	    st.st_size >= COMPRESS_FILE_MIN &&
+	    st.st_size <= COMPRESS_FILE_MAX) {
+		res->compress = accepts_encoding(
+			req->field[REQ_ACCEPT_ENCODING], "gzip");
+	}
+
+	/* the response depends on the field, let caches know */
+	if (vary && esnprintf(res->field[RES_VARY],
+	                      sizeof(res->field[RES_VARY]),
+	                      "%s", "Accept-Encoding")) {
+		s = S_INTERNAL_SERVER_ERROR;
+		goto err;
+	}
+
 	/* modified since */
 	if (req->field[REQ_IF_MODIFIED_SINCE][0]) {
 		/* parse field */
@@ -947,7 +1213,10 @@ http_prepare_response(const struct request *req, struct response *res,
 
 			if (esnprintf(res->field[RES_CONTENT_RANGE],
 			              sizeof(res->field[RES_CONTENT_RANGE]),
-			              "bytes */%zu", st.st_size)) {
+			              "bytes */%zu", st.st_size) ||
+			    esnprintf(res->field[RES_CONTENT_LENGTH],
+			              sizeof(res->field[RES_CONTENT_LENGTH]),
+			              "0")) {
 				s = S_INTERNAL_SERVER_ERROR;
 				goto err;
 			}
@@ -958,19 +1227,9 @@ http_prepare_response(const struct request *req, struct response *res,
 		}
 	}
 
-	/* mime */
-	mime = "application/octet-stream";
-	if ((p = strrchr(res->internal_path, '.'))) {
-		for (i = 0; i < LEN(mimes); i++) {
-			if (!strcmp(mimes[i].ext, p + 1)) {
-				mime = mimes[i].type;
-				break;
-			}
-		}
-	}
-
 	/* fill response struct */
 	res->type = RESTYPE_FILE;
+	res->st = st;
 
 	/* check if file is readable */
 	res->status = (access(res->internal_path, R_OK)) ? S_FORBIDDEN :
@@ -1039,8 +1298,15 @@ http_prepare_error_response(const struct request *req,
 	if (res->status == S_METHOD_NOT_ALLOWED) {
 		if (esnprintf(res->field[RES_ALLOW],
 		              sizeof(res->field[RES_ALLOW]),
-			      "Allow: GET, HEAD")) {
+			      "GET, HEAD")) {
 			res->status = S_INTERNAL_SERVER_ERROR;
 		}
 	}
+
+	/* the body is known in advance */
+	esnprintf(res->field[RES_CONTENT_LENGTH],
+	          sizeof(res->field[RES_CONTENT_LENGTH]), "%d",
+	          snprintf(NULL, 0, error_body_fmt,
+	                   res->status, status_str[res->status],
+	                   res->status, status_str[res->status]));
 }
@@ -4,6 +4,7 @@
 
 #include <limits.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 
 #include "config.h"
 #include "server.h"
@@ -13,6 +14,10 @@ enum req_field {
 	REQ_HOST,
 	REQ_RANGE,
 	REQ_IF_MODIFIED_SINCE,
+	REQ_ACCEPT_ENCODING,
+	REQ_CONNECTION,
+	REQ_UPGRADE,
+	REQ_HTTP2_SETTINGS,
 	NUM_REQ_FIELDS,
 };
 
@@ -32,6 +37,7 @@ struct request {
 	char query[FIELD_MAX];
 	char fragment[FIELD_MAX];
 	char field[NUM_REQ_FIELDS][FIELD_MAX];
+	int keepalive;
 };
 
 enum status {
@@ -47,10 +53,12 @@ enum status {
 	S_RANGE_NOT_SATISFIABLE = 416,
 	S_REQUEST_TOO_LARGE     = 431,
 	S_INTERNAL_SERVER_ERROR = 500,
+	S_SERVICE_UNAVAILABLE   = 503,
 	S_VERSION_NOT_SUPPORTED = 505,
 };
 
 extern const char *status_str[];
+extern const char error_body_fmt[];
 
 enum res_field {
 	RES_ACCEPT_RANGES,
@@ -60,6 +68,8 @@ enum res_field {
 	RES_CONTENT_LENGTH,
 	RES_CONTENT_RANGE,
 	RES_CONTENT_TYPE,
+	RES_CONTENT_ENCODING,
+	RES_VARY,
 	NUM_RES_FIELDS,
 };
 
@@ -68,6 +78,7 @@ extern const char *res_field_str[];
 enum res_type {
 	RESTYPE_DIRLISTING,
 	RESTYPE_ERROR,
+	RESTYPE_CACHED,
 	RESTYPE_FILE,
 	NUM_RES_TYPES,
 };
@@ -79,16 +90,26 @@ struct response {
 	char path[PATH_MAX];
 	char internal_path[PATH_MAX];
 	struct vhost *vhost;
+	struct stat st;
 	struct {
 		size_t lower;
 		size_t upper;
 	} file;
+	char *listing;
+	int compress;
+	int keepalive;
 };
 
 enum status http_prepare_header_buf(const struct response *, struct buffer *);
 enum status http_send_buf(int, struct buffer *);
-enum status http_recv_header(int, struct buffer *, int *);
+size_t http_header_length(const struct buffer *);
+enum status http_recv_header(int, struct buffer *, size_t *);
+enum status http_append_header(struct buffer *, const char *, size_t,
+                               size_t *);
+enum status http_parse_target(const char *, size_t, struct request *);
+enum status http_parse_host(struct request *);
 enum status http_parse_header(const char *, struct request *);
+int http_has_token(const char *, const char *);
 void http_prepare_response(const struct request *, struct response *,
                            const struct server *);
 void http_prepare_error_response(const struct request *,
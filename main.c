@@ -15,6 +15,9 @@
 #include <unistd.h>
 
 #include "arg.h"
+#include "cache.h"
+#include "cpu.h"
+#include "fdcache.h"
 #include "server.h"
 #include "sock.h"
 #include "util.h"
@@ -54,8 +57,10 @@ handlesignals(void(*hdl)(int))
 static void
 usage(void)
 {
-	const char *opts = "[-u user] [-g group] [-n num] [-d dir] [-l] "
-	                   "[-i file] [-v vhost] ... [-m map] ...";
+	const char *opts = "[-u user] [-g group] [-n num] [-f num] "
+	                   "[-b num] [-c num] [-k sec] [-r num] [-d dir] "
+	                   "[-l] [-q] [-z] [-2] [-R] [-a] [-i file] "
+	                   "[-v vhost] ... [-m map] ...";
 
 	die("usage: %s -p port [-h host] %s\n"
 	    "       %s -U file [-p port] %s", argv0,
@@ -65,28 +70,63 @@ usage(void)
 int
 main(int argc, char *argv[])
 {
+	struct cpuset cpus;
 	struct group *grp = NULL;
 	struct passwd *pwd = NULL;
 	struct rlimit rlim;
 	struct server srv = {
 		.docindex = "index.html",
+		.bufsize = 65536,
+		.keepalive = 5,
+		.maxrequests = 100,
 	};
-	size_t i;
-	int insock, status = 0;
+	size_t i, n, ninsock;
+	int *insock, reuseport = 0, status = 0;
 	const char *err;
 	char *tok[4];
 
 	/* defaults */
-	size_t nthreads = 4;
+	size_t nthreads = 0;
 	size_t nslots = 64;
+	size_t nfdcache = 64;
+	size_t ncache = 0;
 	char *servedir = ".";
 	char *user = "nobody";
 	char *group = "nogroup";
 
 	ARGBEGIN {
+	case '2':
+		srv.h2 = 1;
+		break;
+	case 'a':
+		srv.pin = 1;
+		break;
+	case 'b':
+		err = NULL;
+		srv.bufsize = strtonum(EARGF(usage()), BUFFER_SIZE / 1024,
+		                       65536, &err) * 1024;
+		if (err) {
+			die("strtonum '%s': %s", EARGF(usage()), err);
+		}
+		break;
+	case 'c':
+		err = NULL;
+		ncache = strtonum(EARGF(usage()), 0,
+		                  MIN(SIZE_MAX / 1024, LLONG_MAX), &err);
+		if (err) {
+			die("strtonum '%s': %s", EARGF(usage()), err);
+		}
+		break;
 	case 'd':
 		servedir = EARGF(usage());
 		break;
+	case 'f':
+		err = NULL;
+		nfdcache = strtonum(EARGF(usage()), 0, INT_MAX, &err);
+		if (err) {
+			die("strtonum '%s': %s", EARGF(usage()), err);
+		}
+		break;
 	case 'g':
 		group = EARGF(usage());
 		break;
@@ -99,6 +139,13 @@ main(int argc, char *argv[])
 			die("The document index must not contain '/'");
 		}
 		break;
+	case 'k':
+		err = NULL;
+		srv.keepalive = strtonum(EARGF(usage()), 0, 3600, &err);
+		if (err) {
+			die("strtonum '%s': %s", EARGF(usage()), err);
+		}
+		break;
 	case 'l':
 		srv.listdirs = 1;
 		break;
@@ -114,6 +161,19 @@ main(int argc, char *argv[])
 		srv.map[srv.map_len - 1].to    = tok[1];
 		srv.map[srv.map_len - 1].chost = tok[2];
 		break;
+	case 'q':
+		srv.uring = 1;
+		break;
+	case 'R':
+		reuseport = 1;
+		break;
+	case 'r':
+		err = NULL;
+		srv.maxrequests = strtonum(EARGF(usage()), 1, INT_MAX, &err);
+		if (err) {
+			die("strtonum '%s': %s", EARGF(usage()), err);
+		}
+		break;
 	case 's':
 		err = NULL;
 		nslots = strtonum(EARGF(usage()), 1, INT_MAX, &err);
@@ -151,6 +211,9 @@ main(int argc, char *argv[])
 		srv.vhost[srv.vhost_len - 1].dir    = tok[2];
 		srv.vhost[srv.vhost_len - 1].prefix = tok[3];
 		break;
+	case 'z':
+		srv.compress = 1;
+		break;
 	default:
 		usage();
 	} ARGEND
@@ -159,6 +222,42 @@ main(int argc, char *argv[])
 		usage();
 	}
 
+	/* compressed output is only ever served from the content cache */
+	if (srv.compress && ncache == 0) {
+		die("compression (-z) requires the content cache (-c)");
+	}
+
+	/* HTTP/2 connections persist by nature */
+	if (srv.h2 && !srv.keepalive) {
+		die("HTTP/2 (-2) requires keep-alive (-k)");
+	}
+
+	/* listening sockets per worker share a port */
+	if (reuseport && udsname) {
+		die("per-worker listening sockets (-R) require a port (-p)");
+	}
+	#ifndef __linux__
+		if (reuseport) {
+			die("per-worker listening sockets (-R) are only "
+			    "supported on Linux");
+		}
+		if (srv.pin) {
+			die("pinning threads to CPUs (-a) is only "
+			    "supported on Linux");
+		}
+	#endif
+
+	/*
+	 * by default, run a thread for each CPU we are allowed on,
+	 * but not more than our cgroup's CPU quota can keep busy
+	 */
+	if (nthreads == 0) {
+		nthreads = cpu_get_allowed(&cpus) ? 4 : cpu_count(&cpus);
+		if ((n = cpu_get_quota()) > 0) {
+			nthreads = MIN(nthreads, n);
+		}
+	}
+
 	/* can't have both host and UDS but must have one of port or UDS*/
 	if ((srv.host && udsname) || !(srv.port || udsname)) {
 		usage();
@@ -195,15 +294,28 @@ main(int argc, char *argv[])
 
 	handlesignals(sigcleanup);
 
+	/* only the serving process reports on SIGUSR1, we ignore it */
+	if (signal(SIGUSR1, SIG_IGN) == SIG_ERR) {
+		die("signal: Failed to set SIG_IGN on SIGUSR1");
+	}
+
 	/*
 	 * set the maximum number of open file descriptors as needed
 	 *  - 3 initial fd's
 	 *  - nthreads fd's for the listening socket
-	 *  - (nthreads * nslots) fd's for the connection-fd
+	 *  - (nthreads * nslots) fd's for the connection-fd, which
+	 *    the threads share
+	 *  - (nthreads * nslots) fd's for the file-fd held by each
+	 *    connection, or H2_STREAMS_MAX times as many with HTTP/2,
+	 *    where each stream of a connection holds its own
+	 *  - nfdcache fd's held by the shared file-fd cache
+	 *  - 1 fd for the in-memory content cache
 	 *  - (5 * nthreads) fd's for general purpose thread-use
 	 */
 	rlim.rlim_cur = rlim.rlim_max = 3 + nthreads + nthreads * nslots +
-	                                5 * nthreads;
+	                                nthreads * nslots *
+	                                (srv.h2 ? H2_STREAMS_MAX : 1) +
+	                                nfdcache + 1 + 5 * nthreads;
 	if (setrlimit(RLIMIT_NOFILE, &rlim) < 0) {
 		if (errno == EPERM) {
 			die("You need to run as root or have "
@@ -217,21 +329,32 @@ main(int argc, char *argv[])
 	/*
 	 * create the (non-blocking) listening socket
 	 *
-	 * we could use SO_REUSEPORT and create a listening socket for
-	 * each thread (for better load-balancing, given each thread
-	 * would get his own kernel-queue), but this increases latency
-	 * (as a thread might get stuck on a larger request, making all
+	 * by default, the threads share a single listening socket.
+	 * With SO_REUSEPORT (-R), each thread gets its own, and with
+	 * it its own kernel-queue, but this increases latency (as a
+	 * thread might get stuck on a larger request, making all
 	 * other request wait in line behind it).
 	 *
 	 * socket contention with a single listening socket is a
-	 * non-issue and thread-load-balancing is better fixed in the
-	 * kernel by changing epoll-sheduling from a FIFO- to a
-	 * LIFO-model, especially as it doesn't affect performance
+	 * non-issue on most machines. On those with many cores, the
+	 * shared queue is a cache line every core fights over, and a
+	 * connection is better handed to the socket of the CPU it
+	 * arrived on
 	 */
-	insock = udsname ? sock_get_uds(udsname, pwd->pw_uid, grp->gr_gid) :
-	                   sock_get_ips(srv.host, srv.port);
-	if (sock_set_nonblocking(insock)) {
-		return 1;
+	ninsock = reuseport ? nthreads : 1;
+	if (!(insock = reallocarray(NULL, ninsock, sizeof(*insock)))) {
+		die("reallocarray:");
+	}
+	for (i = 0; i < ninsock; i++) {
+		insock[i] = udsname ?
+		            sock_get_uds(udsname, pwd->pw_uid, grp->gr_gid) :
+		            sock_get_ips(srv.host, srv.port, reuseport);
+		if (sock_set_nonblocking(insock[i])) {
+			return 1;
+		}
+	}
+	if (reuseport) {
+		sock_steer_cpu(insock[0], ninsock);
 	}
 
 	/*
@@ -339,8 +462,13 @@ main(int argc, char *argv[])
 			epledge("stdio rpath proc inet", NULL);
 		}
 
+		/* set up the shared file-fd and content caches */
+		fdcache_init(nfdcache);
+		cache_init(ncache * 1024);
+
 		/* accept incoming connections */
-		server_init_thread_pool(insock, nthreads, nslots, &srv);
+		server_init_thread_pool(insock, ninsock, nthreads, nslots,
+		                        &srv);
 
 		exit(0);
 	default:
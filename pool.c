@@ -0,0 +1,70 @@
+/* See LICENSE file for copyright and license details. */
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "pool.h"
+#include "util.h"
+
+/*
+ * allocator for objects of one size, owned by a single worker thread
+ * and thus without locking. Released objects are kept on a free list
+ * (linked through the objects themselves) for reuse, but at most
+ * maxfree of them, so a burst doesn't pin its peak memory forever.
+ */
+struct pool {
+	size_t size;
+	size_t nfree;
+	size_t maxfree;
+	void *free;
+};
+
+struct pool *
+pool_create(size_t size, size_t maxfree)
+{
+	struct pool *p;
+
+	if (!(p = calloc(1, sizeof(*p)))) {
+		warn("calloc:");
+		return NULL;
+	}
+	p->size = MAX(size, sizeof(void *));
+	p->maxfree = maxfree;
+
+	return p;
+}
+
+size_t
+pool_size(const struct pool *p)
+{
+	return p->size;
+}
+
+void *
+pool_get(struct pool *p)
+{
+	void *o;
+
+	if ((o = p->free) != NULL) {
+		p->free = *(void **)o;
+		p->nfree--;
+	} else {
+		o = malloc(p->size);
+	}
+
+	return o;
+}
+
+void
+pool_put(struct pool *p, void *o)
+{
+	if (o == NULL) {
+		return;
+	}
+	if (p->nfree == p->maxfree) {
+		free(o);
+		return;
+	}
+	*(void **)o = p->free;
+	p->free = o;
+	p->nfree++;
+}
@@ -0,0 +1,14 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+struct pool;
+
+struct pool *pool_create(size_t, size_t);
+size_t pool_size(const struct pool *);
+void *pool_get(struct pool *);
+void pool_put(struct pool *, void *);
+
+#endif /* POOL_H */
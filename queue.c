@@ -1,8 +1,16 @@
 /* See LICENSE file for copyright and license details. */
+#include <errno.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 
 #ifdef __linux__
+	#include <linux/io_uring.h>
 	#include <sys/epoll.h>
+	#include <sys/mman.h>
+	#include <sys/socket.h>
+	#include <sys/syscall.h>
+	#include <unistd.h>
 #else
 	#include <sys/types.h>
 	#include <sys/event.h>
@@ -12,26 +20,685 @@
 #include "queue.h"
 #include "util.h"
 
-int
-queue_create(void)
+#ifdef __linux__
+/*
+ * a multishot receive on a connection. It is "live" until it is
+ * cancelled, and only freed after its final completion, as the
+ * kernel may complete it long after the connection is gone
+ */
+struct queue_recv {
+	int fd;
+	void *data;
+	int live;
+	struct queue_recv *next;
+};
+
+struct queue_fd {
+	struct queue_recv *recv;
+	int registered;
+};
+#endif
+
+struct queue {
+	int fd;
+	#ifdef __linux__
+		struct epoll_event *ready_event;
+		size_t nready_event;
+
+		/*
+		 * optional io_uring, which submits all epoll_ctl()'s
+		 * queued since the last queue_wait() in one batch
+		 * together with the wait itself. Sends and file reads
+		 * are left to the connections, which resume partial
+		 * sends from their own cursor and use sendfile(), for
+		 * which the ring has no counterpart
+		 */
+		int ringfd;
+		unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+		unsigned *cq_head, *cq_tail, *cq_mask;
+		struct io_uring_sqe *sqe;
+		struct io_uring_cqe *cqe;
+		struct epoll_event *sqe_event;
+		unsigned sq_entries, tail, pending;
+		int polling, ready;
+
+		/*
+		 * if the kernel supports it, the ring also accept()s
+		 * on the listening socket with a multishot accept and
+		 * receives the header of each connection with a
+		 * multishot receive into buffers it picks from a ring
+		 * shared by all connections, so only connections that
+		 * actually sent something occupy a buffer. The buffers
+		 * handed out with the events of one queue_wait() are
+		 * returned to the ring on the next one
+		 */
+		int acceptfd, accepting;
+		const void *acceptdata;
+		struct io_uring_buf_ring *br;
+		char *bufs;
+		unsigned short *usedbuf;
+		unsigned nbufs, brtail, nusedbuf;
+		struct queue_fd *fds;
+		size_t nfds;
+		struct queue_recv *ended;
+	#endif
+};
+
+#ifdef __linux__
+/*
+ * user data of requests that are not tied to a connection. The tag of
+ * an epoll_ctl() may also be or'ed into the (aligned) data pointer of
+ * the connection it is made for, which is told if it fails
+ */
+#define QUEUE_POLL_TAG   1
+#define QUEUE_CTL_TAG    2
+#define QUEUE_CANCEL_TAG 3
+#define QUEUE_ACCEPT_TAG 4
+#define QUEUE_TAG_MASK   7
+
+/* id and size of the provided receive buffers */
+#define QUEUE_BUF_GROUP 0
+#define QUEUE_BUF_SIZE  4096
+
+static ssize_t
+epoll_fetch(struct queue *q, queue_event *e, size_t elen, int timeout)
+{
+	ssize_t nready, i;
+
+	if (elen > q->nready_event) {
+		if (!(q->ready_event = reallocarray(q->ready_event, elen,
+		                                    sizeof(*q->ready_event)))) {
+			die("reallocarray:");
+		}
+		q->nready_event = elen;
+	}
+	if ((nready = epoll_wait(q->fd, q->ready_event, elen, timeout)) < 0) {
+		warn("epoll_wait:");
+		return -1;
+	}
+	for (i = 0; i < nready; i++) {
+		memset(&e[i], 0, sizeof(e[i]));
+		e[i].events   = q->ready_event[i].events;
+		e[i].data     = q->ready_event[i].data.ptr;
+		e[i].accepted = -1;
+	}
+
+	return nready;
+}
+
+static int
+uring_supports(int ringfd, const int *op, size_t oplen)
+{
+	struct io_uring_probe *probe;
+	size_t i;
+	int ret = 1;
+
+	if (!(probe = calloc(1, sizeof(*probe) + IORING_OP_LAST *
+	                     sizeof(struct io_uring_probe_op)))) {
+		return 0;
+	}
+	if (syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_PROBE,
+	            probe, IORING_OP_LAST) < 0) {
+		ret = 0;
+	}
+	for (i = 0; ret && i < oplen; i++) {
+		if (op[i] > probe->last_op ||
+		    !(probe->ops[op[i]].flags & IO_URING_OP_SUPPORTED)) {
+			ret = 0;
+		}
+	}
+	free(probe);
+
+	return ret;
+}
+
+static void
+uring_provide_buffer(struct queue *q, unsigned short bid)
+{
+	struct io_uring_buf *b = &q->br->bufs[q->brtail & (q->nbufs - 1)];
+
+	/* the tail is published by the caller */
+	b->addr = (unsigned long)(q->bufs + (size_t)bid * QUEUE_BUF_SIZE);
+	b->len  = QUEUE_BUF_SIZE;
+	b->bid  = bid;
+	q->brtail++;
+}
+
+static int
+uring_setup_buffers(struct queue *q, size_t nslots)
+{
+	struct io_uring_buf_reg reg;
+	size_t brlen;
+	unsigned i;
+
+	/*
+	 * headers are usually received in one piece and copied out
+	 * right away, so a buffer for every fourth slot is plenty;
+	 * if we ever run out, the affected receives end and are
+	 * rearmed by the next queue_mod_fd()
+	 */
+	for (q->nbufs = 16; q->nbufs < nslots / 4 && q->nbufs < 32768;
+	     q->nbufs *= 2)
+		;
+	brlen = q->nbufs * sizeof(struct io_uring_buf);
+	if ((q->br = mmap(NULL, brlen, PROT_READ | PROT_WRITE,
+	                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		q->br = NULL;
+		return 1;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr    = (unsigned long)q->br;
+	reg.ring_entries = q->nbufs;
+	reg.bgid         = QUEUE_BUF_GROUP;
+	if (syscall(__NR_io_uring_register, q->ringfd,
+	            IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		munmap(q->br, brlen);
+		q->br = NULL;
+		return 1;
+	}
+
+	if (!(q->bufs = reallocarray(NULL, q->nbufs, QUEUE_BUF_SIZE)) ||
+	    !(q->usedbuf = reallocarray(NULL, q->nbufs,
+	                                sizeof(*q->usedbuf)))) {
+		die("reallocarray:");
+	}
+	for (i = 0; i < q->nbufs; i++) {
+		uring_provide_buffer(q, i);
+	}
+	__atomic_store_n(&q->br->tail, q->brtail, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static int
+uring_setup(struct queue *q, size_t entries)
+{
+	struct io_uring_params p;
+	const int op[] = { IORING_OP_EPOLL_CTL, IORING_OP_POLL_ADD };
+	const int multishot_op[] = { IORING_OP_ACCEPT, IORING_OP_RECV,
+	                             IORING_OP_ASYNC_CANCEL,
+	                             IORING_OP_SEND_ZC };
+	size_t sqlen, cqlen;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CLAMP;
+	if ((q->ringfd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+		return 1;
+	}
+
+	/* we need skippable CQEs and epoll_ctl()/poll support */
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_NODROP) ||
+	    !(p.features & IORING_FEAT_CQE_SKIP) ||
+	    !(p.features & IORING_FEAT_EXT_ARG) ||
+	    !uring_supports(q->ringfd, op, LEN(op))) {
+		goto err;
+	}
+
+	/* map the rings and submission queue entries */
+	sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((sq = cq = mmap(NULL, MAX(sqlen, cqlen), PROT_READ | PROT_WRITE,
+	                    MAP_SHARED | MAP_POPULATE, q->ringfd,
+	                    IORING_OFF_SQ_RING)) == MAP_FAILED) {
+		goto err;
+	}
+	if ((q->sqe = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                   q->ringfd, IORING_OFF_SQES)) == MAP_FAILED) {
+		munmap(sq, MAX(sqlen, cqlen));
+		goto err;
+	}
+	if (!(q->sqe_event = reallocarray(NULL, p.sq_entries,
+	                                  sizeof(*q->sqe_event)))) {
+		die("reallocarray:");
+	}
+
+	q->sq_head    = (unsigned *)(sq + p.sq_off.head);
+	q->sq_tail    = (unsigned *)(sq + p.sq_off.tail);
+	q->sq_mask    = (unsigned *)(sq + p.sq_off.ring_mask);
+	q->sq_array   = (unsigned *)(sq + p.sq_off.array);
+	q->cq_head    = (unsigned *)(cq + p.cq_off.head);
+	q->cq_tail    = (unsigned *)(cq + p.cq_off.tail);
+	q->cq_mask    = (unsigned *)(cq + p.cq_off.ring_mask);
+	q->cqe        = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	q->sq_entries = p.sq_entries;
+	q->tail       = *q->sq_tail;
+	q->pending    = 0;
+	q->acceptfd   = -1;
+
+	/*
+	 * multishot receives came with Linux 6.0, just like
+	 * IORING_OP_SEND_ZC, which unlike them can be probed for
+	 */
+	if (uring_supports(q->ringfd, multishot_op, LEN(multishot_op)) &&
+	    uring_setup_buffers(q, entries)) {
+		warn("io_uring: Couldn't set up receive buffers");
+	}
+
+	return 0;
+err:
+	close(q->ringfd);
+	q->ringfd = -1;
+	return 1;
+}
+
+static int
+uring_submit(struct queue *q, unsigned wait, int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned flags = 0;
+	int r;
+
+	/* wait at most timeout milliseconds, unless it is negative */
+	memset(&arg, 0, sizeof(arg));
+	if (wait) {
+		flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		if (timeout >= 0) {
+			ts.tv_sec  = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000L;
+			arg.ts = (unsigned long)&ts;
+		}
+	}
+
+	/* publish the queued entries and enter the kernel */
+	__atomic_store_n(q->sq_tail, q->tail, __ATOMIC_RELEASE);
+	while ((r = syscall(__NR_io_uring_enter, q->ringfd, q->pending, wait,
+	                    flags, wait ? &arg : NULL,
+	                    wait ? sizeof(arg) : 0)) < 0) {
+		if (errno == ETIME) {
+			/* nothing to submit and nothing completed */
+			r = 0;
+			break;
+		}
+		if (errno != EINTR) {
+			warn("io_uring_enter:");
+			return -1;
+		}
+	}
+	q->pending -= r;
+
+	return 0;
+}
+
+static struct io_uring_sqe *
+uring_get_sqe(struct queue *q, unsigned *idx)
+{
+	struct io_uring_sqe *sqe;
+
+	/* flush the submission queue if it is full */
+	if (q->tail - __atomic_load_n(q->sq_head, __ATOMIC_ACQUIRE) >=
+	    q->sq_entries && uring_submit(q, 0, 0) < 0) {
+		return NULL;
+	}
+
+	*idx = q->tail & *q->sq_mask;
+	q->sq_array[*idx] = *idx;
+	sqe = &q->sqe[*idx];
+	memset(sqe, 0, sizeof(*sqe));
+	q->tail++;
+	q->pending++;
+
+	return sqe;
+}
+
+static int
+uring_epoll_ctl(struct queue *q, int op, int fd, const struct epoll_event *e)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	if (!(sqe = uring_get_sqe(q, &idx))) {
+		return -1;
+	}
+
+	/*
+	 * the event is only read on submission, so we keep it
+	 * alongside the entry until then. Only failures generate
+	 * a completion, which carries the connection's data to
+	 * report the failure to it, as we have long returned
+	 */
+	sqe->user_data = QUEUE_CTL_TAG;
+	if (e != NULL) {
+		q->sqe_event[idx] = *e;
+		if (e->data.ptr != NULL) {
+			sqe->user_data |= (unsigned long)e->data.ptr;
+		}
+	}
+	sqe->opcode    = IORING_OP_EPOLL_CTL;
+	sqe->flags     = IOSQE_CQE_SKIP_SUCCESS;
+	sqe->fd        = q->fd;
+	sqe->len       = op;
+	sqe->off       = fd;
+	sqe->addr      = (unsigned long)&q->sqe_event[idx];
+
+	return 0;
+}
+
+static struct queue_fd *
+uring_fd(struct queue *q, int fd)
+{
+	size_t n;
+
+	if ((size_t)fd >= q->nfds) {
+		n = MAX((size_t)fd + 1, 2 * q->nfds);
+		if (!(q->fds = reallocarray(q->fds, n, sizeof(*q->fds)))) {
+			die("reallocarray:");
+		}
+		memset(q->fds + q->nfds, 0, (n - q->nfds) * sizeof(*q->fds));
+		q->nfds = n;
+	}
+
+	return &q->fds[fd];
+}
+
+static int
+uring_accept(struct queue *q)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	if (!(sqe = uring_get_sqe(q, &idx))) {
+		return -1;
+	}
+	sqe->opcode       = IORING_OP_ACCEPT;
+	sqe->fd           = q->acceptfd;
+	sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data    = QUEUE_ACCEPT_TAG;
+	q->accepting = 1;
+
+	return 0;
+}
+
+static int
+uring_recv(struct queue *q, int fd, const void *data)
+{
+	struct io_uring_sqe *sqe;
+	struct queue_recv *r;
+	unsigned idx;
+
+	if (!(r = calloc(1, sizeof(*r)))) {
+		warn("calloc:");
+		return -1;
+	}
+	if (!(sqe = uring_get_sqe(q, &idx))) {
+		free(r);
+		return -1;
+	}
+	r->fd   = fd;
+	r->data = (void *)data;
+	r->live = 1;
+
+	sqe->opcode    = IORING_OP_RECV;
+	sqe->flags     = IOSQE_BUFFER_SELECT;
+	sqe->fd        = fd;
+	sqe->ioprio    = IORING_RECV_MULTISHOT;
+	sqe->buf_group = QUEUE_BUF_GROUP;
+	sqe->user_data = (unsigned long)r;
+	uring_fd(q, fd)->recv = r;
+
+	return 0;
+}
+
+static int
+uring_cancel_recv(struct queue *q, int fd)
 {
-	int qfd;
+	struct io_uring_sqe *sqe;
+	struct queue_fd *f = uring_fd(q, fd);
+	unsigned idx;
+
+	if (f->recv == NULL) {
+		return 0;
+	}
+
+	/*
+	 * whatever the receive still delivers is discarded, it only
+	 * has to be waited for before it can be freed
+	 */
+	f->recv->live = 0;
+	if (!(sqe = uring_get_sqe(q, &idx))) {
+		return -1;
+	}
+	sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+	sqe->flags     = IOSQE_CQE_SKIP_SUCCESS;
+	sqe->addr      = (unsigned long)f->recv;
+	sqe->user_data = QUEUE_CANCEL_TAG;
+	f->recv = NULL;
+
+	return 0;
+}
+
+static void
+uring_recycle(struct queue *q)
+{
+	struct queue_recv *r;
+
+	/*
+	 * the events of the last queue_wait() have been handled, so
+	 * their buffers and ended receives are no longer referenced
+	 */
+	if (q->nusedbuf > 0) {
+		for (; q->nusedbuf > 0; q->nusedbuf--) {
+			uring_provide_buffer(q, q->usedbuf[q->nusedbuf - 1]);
+		}
+		__atomic_store_n(&q->br->tail, q->brtail, __ATOMIC_RELEASE);
+	}
+	while ((r = q->ended) != NULL) {
+		q->ended = r->next;
+		free(r);
+	}
+}
+
+static int
+uring_reap_ctl(const struct io_uring_cqe *cqe, queue_event *e)
+{
+	/*
+	 * a failed epoll_ctl(). ENOENT and EBADF are expected when the
+	 * fd has been closed (and thus removed from epoll) before we
+	 * submitted
+	 */
+	if (cqe->res == -ENOENT || cqe->res == -EBADF) {
+		return 0;
+	}
+	errno = -cqe->res;
+	warn("epoll_ctl:");
+	if (cqe->user_data == QUEUE_CTL_TAG) {
+		/* not made for a connection */
+		return 0;
+	}
+
+	/*
+	 * the connection would wait for events that never come,
+	 * report an error for it instead
+	 */
+	memset(e, 0, sizeof(*e));
+	e->events   = EPOLLERR;
+	e->data     = (void *)(unsigned long)(cqe->user_data &
+	                                      ~(unsigned long)QUEUE_TAG_MASK);
+	e->accepted = -1;
+
+	return 1;
+}
+
+static int
+uring_reap_recv(struct queue *q, const struct io_uring_cqe *cqe,
+                queue_event *e)
+{
+	struct queue_recv *r = (struct queue_recv *)cqe->user_data;
+	struct queue_fd *f;
+
+	memset(e, 0, sizeof(*e));
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		q->usedbuf[q->nusedbuf++] = cqe->flags >>
+		                            IORING_CQE_BUFFER_SHIFT;
+		e->received = q->bufs + (size_t)(cqe->flags >>
+		              IORING_CQE_BUFFER_SHIFT) * QUEUE_BUF_SIZE;
+		e->len = cqe->res;
+	}
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		/*
+		 * the receive has ended (hangup, error or we ran out
+		 * of buffers), which we report as a plain readiness
+		 * event with no data, so the connection just read()s
+		 */
+		if ((f = uring_fd(q, r->fd))->recv == r) {
+			f->recv = NULL;
+		}
+		r->next = q->ended;
+		q->ended = r;
+	} else if (e->received == NULL) {
+		return 0;
+	}
+	if (!r->live) {
+		return 0;
+	}
+	e->events   = EPOLLIN;
+	e->data     = r->data;
+	e->accepted = -1;
+	e->recv     = r;
+
+	return 1;
+}
+
+static ssize_t
+uring_wait(struct queue *q, queue_event *e, size_t elen, int timeout)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned head, idx;
+	ssize_t n, nready;
+
+	if (q->br != NULL) {
+		uring_recycle(q);
+	}
+
+	/* watch the epoll fd with a multishot poll */
+	if (!q->polling) {
+		if (!(sqe = uring_get_sqe(q, &idx))) {
+			return -1;
+		}
+		sqe->opcode       = IORING_OP_POLL_ADD;
+		sqe->fd           = q->fd;
+		sqe->poll32_events = EPOLLIN;
+		sqe->len          = IORING_POLL_ADD_MULTI;
+		sqe->user_data    = QUEUE_POLL_TAG;
+		q->polling = 1;
+	}
+	if (q->acceptfd >= 0 && !q->accepting && uring_accept(q) < 0) {
+		return -1;
+	}
+
+	/*
+	 * submit everything queued and, unless epoll still has ready
+	 * events or there are completions we could not fetch last
+	 * time, wait for a completion
+	 */
+	if (uring_submit(q, !q->ready && *q->cq_head ==
+	                 __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE),
+	                 timeout) < 0) {
+		return -1;
+	}
+
+	/* reap completions */
+	head = *q->cq_head;
+	for (n = 0; (size_t)n < elen &&
+	     head != __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE); head++) {
+		cqe = &q->cqe[head & *q->cq_mask];
+
+		switch (cqe->user_data) {
+		case QUEUE_POLL_TAG:
+			q->ready = 1;
+			if (!(cqe->flags & IORING_CQE_F_MORE)) {
+				/* the multishot poll has ended, rearm */
+				q->polling = 0;
+			}
+			break;
+		case QUEUE_CANCEL_TAG:
+			/* the receive had already ended */
+			break;
+		case QUEUE_ACCEPT_TAG:
+			if (!(cqe->flags & IORING_CQE_F_MORE)) {
+				/* the multishot accept has ended, rearm */
+				q->accepting = 0;
+			}
+			if (cqe->res < 0) {
+				if (cqe->res != -EAGAIN) {
+					errno = -cqe->res;
+					warn("accept:");
+				}
+				break;
+			}
+			memset(&e[n], 0, sizeof(e[n]));
+			e[n].events   = EPOLLIN;
+			e[n].data     = (void *)q->acceptdata;
+			e[n].accepted = cqe->res;
+			n++;
+			break;
+		default:
+			if ((cqe->user_data & QUEUE_TAG_MASK) ==
+			    QUEUE_CTL_TAG) {
+				n += uring_reap_ctl(cqe, &e[n]);
+			} else {
+				n += uring_reap_recv(q, cqe, &e[n]);
+			}
+		}
+	}
+	__atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+
+	if (!q->ready || (size_t)n == elen) {
+		return n;
+	}
+
+	/* fetch the ready events without blocking */
+	if ((nready = epoll_fetch(q, e + n, elen - n, 0)) < 0) {
+		return -1;
+	}
+	q->ready = ((size_t)nready == elen - n);
+
+	return n + nready;
+}
+#endif
+
+struct queue *
+queue_create(size_t nslots, int uring)
+{
+	struct queue *q;
+
+	if (!(q = calloc(1, sizeof(*q)))) {
+		warn("calloc:");
+		return NULL;
+	}
 
 	#ifdef __linux__
-		if ((qfd = epoll_create1(0)) < 0) {
+		if ((q->fd = epoll_create1(0)) < 0) {
 			warn("epoll_create1:");
+			free(q);
+			return NULL;
+		}
+
+		q->ringfd = -1;
+		if (uring && uring_setup(q, nslots)) {
+			warn("io_uring unavailable, falling back to epoll");
 		}
 	#else
-		if ((qfd = kqueue()) < 0) {
+		(void)nslots;
+		(void)uring;
+
+		if ((q->fd = kqueue()) < 0) {
 			warn("kqueue:");
+			free(q);
+			return NULL;
 		}
 	#endif
 
-	return qfd;
+	return q;
 }
 
 int
-queue_add_fd(int qfd, int fd, enum queue_event_type t, int shared,
+queue_add_fd(struct queue *q, int fd, enum queue_event_type t, int shared,
              const void *data)
 {
 	#ifdef __linux__
@@ -68,8 +735,34 @@ queue_add_fd(int qfd, int fd, enum queue_event_type t, int shared,
 		/* set data pointer */
 		e.data.ptr = (void *)data;
 
+		if (q->br != NULL && shared && t == QUEUE_EVENT_IN) {
+			/* accept() with the ring instead */
+			q->acceptfd   = fd;
+			q->acceptdata = data;
+			return uring_accept(q);
+		}
+		if (q->br != NULL && !shared) {
+			/*
+			 * the fd may reuse the number of one we have
+			 * not been told about being closed, whose
+			 * receive must not be mistaken for ours
+			 */
+			if (uring_cancel_recv(q, fd) < 0) {
+				return -1;
+			}
+			if (t == QUEUE_EVENT_IN) {
+				/* receive with the ring instead */
+				uring_fd(q, fd)->registered = 0;
+				return uring_recv(q, fd, data);
+			}
+			uring_fd(q, fd)->registered = 1;
+		}
+
 		/* register fd in the interest list */
-		if (epoll_ctl(qfd, EPOLL_CTL_ADD, fd, &e) < 0) {
+		if (q->ringfd >= 0) {
+			return uring_epoll_ctl(q, EPOLL_CTL_ADD, fd, &e);
+		}
+		if (epoll_ctl(q->fd, EPOLL_CTL_ADD, fd, &e) < 0) {
 			warn("epoll_ctl:");
 			return -1;
 		}
@@ -91,7 +784,7 @@ queue_add_fd(int qfd, int fd, enum queue_event_type t, int shared,
 
 		EV_SET(&e, fd, events, EV_ADD, 0, 0, (void *)data);
 
-		if (kevent(qfd, &e, 1, NULL, 0, NULL) < 0) {
+		if (kevent(q->fd, &e, 1, NULL, 0, NULL) < 0) {
 			warn("kevent:");
 			return -1;
 		}
@@ -101,10 +794,12 @@ queue_add_fd(int qfd, int fd, enum queue_event_type t, int shared,
 }
 
 int
-queue_mod_fd(int qfd, int fd, enum queue_event_type t, const void *data)
+queue_mod_fd(struct queue *q, int fd, enum queue_event_type t,
+             const void *data)
 {
 	#ifdef __linux__
 		struct epoll_event e;
+		struct queue_fd *f;
 
 		/* set event flag (only for non-shared fd's) */
 		e.events = EPOLLET;
@@ -121,8 +816,46 @@ queue_mod_fd(int qfd, int fd, enum queue_event_type t, const void *data)
 		/* set data pointer */
 		e.data.ptr = (void *)data;
 
+		if (q->br != NULL) {
+			f = uring_fd(q, fd);
+
+			if (t == QUEUE_EVENT_IN) {
+				/*
+				 * silence epoll, as a readiness event
+				 * would make the connection read()
+				 * concurrently to the receive
+				 */
+				if (f->registered) {
+					e.events = EPOLLET;
+					if (uring_epoll_ctl(q, EPOLL_CTL_MOD,
+					                    fd, &e) < 0) {
+						return -1;
+					}
+				}
+				if (f->recv != NULL) {
+					/* still receiving */
+					return 0;
+				}
+				return uring_recv(q, fd, data);
+			}
+
+			/*
+			 * the receive goes on while we send, handing the
+			 * connection pipelined requests as they arrive.
+			 * The fd is only added to epoll once needed
+			 */
+			if (!f->registered) {
+				f->registered = 1;
+				return uring_epoll_ctl(q, EPOLL_CTL_ADD, fd,
+				                       &e);
+			}
+		}
+
 		/* register fd in the interest list */
-		if (epoll_ctl(qfd, EPOLL_CTL_MOD, fd, &e) < 0) {
+		if (q->ringfd >= 0) {
+			return uring_epoll_ctl(q, EPOLL_CTL_MOD, fd, &e);
+		}
+		if (epoll_ctl(q->fd, EPOLL_CTL_MOD, fd, &e) < 0) {
 			warn("epoll_ctl:");
 			return -1;
 		}
@@ -143,7 +876,7 @@ queue_mod_fd(int qfd, int fd, enum queue_event_type t, const void *data)
 
 		EV_SET(&e, fd, events, EV_ADD, 0, 0, (void *)data);
 
-		if (kevent(qfd, &e, 1, NULL, 0, NULL) < 0) {
+		if (kevent(q->fd, &e, 1, NULL, 0, NULL) < 0) {
 			warn("kevent:");
 			return -1;
 		}
@@ -153,12 +886,24 @@ queue_mod_fd(int qfd, int fd, enum queue_event_type t, const void *data)
 }
 
 int
-queue_rem_fd(int qfd, int fd)
+queue_rem_fd(struct queue *q, int fd)
 {
 	#ifdef __linux__
 		struct epoll_event e;
 
-		if (epoll_ctl(qfd, EPOLL_CTL_DEL, fd, &e) < 0) {
+		if (q->br != NULL) {
+			if (uring_cancel_recv(q, fd) < 0) {
+				return -1;
+			}
+			if (!uring_fd(q, fd)->registered) {
+				return 0;
+			}
+			uring_fd(q, fd)->registered = 0;
+		}
+		if (q->ringfd >= 0) {
+			return uring_epoll_ctl(q, EPOLL_CTL_DEL, fd, NULL);
+		}
+		if (epoll_ctl(q->fd, EPOLL_CTL_DEL, fd, &e) < 0) {
 			warn("epoll_ctl:");
 			return -1;
 		}
@@ -167,7 +912,7 @@ queue_rem_fd(int qfd, int fd)
 
 		EV_SET(&e, fd, 0, EV_DELETE, 0, 0, 0);
 
-		if (kevent(qfd, &e, 1, NULL, 0, NULL) < 0) {
+		if (kevent(q->fd, &e, 1, NULL, 0, NULL) < 0) {
 			warn("kevent:");
 			return -1;
 		}
@@ -176,18 +921,45 @@ queue_rem_fd(int qfd, int fd)
 	return 0;
 }
 
+void
+queue_forget_fd(struct queue *q, int fd)
+{
+	#ifdef __linux__
+		/*
+		 * the fd is about to be closed, which removes it from
+		 * the epoll interest list, but not the receive the ring
+		 * may still complete on behalf of its connection
+		 */
+		if (q->br != NULL && uring_cancel_recv(q, fd) == 0) {
+			uring_fd(q, fd)->registered = 0;
+		}
+	#else
+		/* closing the fd removes its kevents */
+		(void)q;
+		(void)fd;
+	#endif
+}
+
 ssize_t
-queue_wait(int qfd, queue_event *e, size_t elen)
+queue_wait(struct queue *q, queue_event *e, size_t elen, int timeout)
 {
 	ssize_t nready;
 
+	/* a negative timeout (in milliseconds) waits indefinitely */
 	#ifdef __linux__
-		if ((nready = epoll_wait(qfd, e, elen, -1)) < 0) {
-			warn("epoll_wait:");
+		if (q->ringfd >= 0) {
+			return uring_wait(q, e, elen, timeout);
+		}
+		if ((nready = epoll_fetch(q, e, elen, timeout)) < 0) {
 			return -1;
 		}
 	#else
-		if ((nready = kevent(qfd, NULL, 0, e, elen, NULL)) < 0) {
+		struct timespec ts;
+
+		ts.tv_sec  = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		if ((nready = kevent(q->fd, NULL, 0, e, elen,
+		                     (timeout < 0) ? NULL : &ts)) < 0) {
 			warn("kevent:");
 			return -1;
 		}
@@ -200,12 +972,38 @@ void *
 queue_event_get_data(const queue_event *e)
 {
 	#ifdef __linux__
-		return e->data.ptr;
+		return e->data;
 	#else
 		return e->udata;
 	#endif
 }
 
+int
+queue_event_get_accepted(const queue_event *e)
+{
+	/* the fd the queue has accept()ed for us, if any */
+	#ifdef __linux__
+		return e->accepted;
+	#else
+		(void)e;
+		return -1;
+	#endif
+}
+
+const char *
+queue_event_get_received(const queue_event *e, size_t *len)
+{
+	/* the data the queue has received for us, if any */
+	#ifdef __linux__
+		*len = e->len;
+		return e->received;
+	#else
+		(void)e;
+		*len = 0;
+		return NULL;
+	#endif
+}
+
 int
 queue_event_is_error(const queue_event *e)
 {
@@ -215,3 +1013,21 @@ queue_event_is_error(const queue_event *e)
 		return (e->flags & EV_EOF) ? 1 : 0;
 	#endif
 }
+
+int
+queue_event_is_stale(const queue_event *e, int fd)
+{
+	#ifdef __linux__
+		const struct queue_recv *r = e->recv;
+
+		/*
+		 * a completion of a receive that has been cancelled or
+		 * belongs to a previous connection with the same data
+		 */
+		return r != NULL && (!r->live || r->fd != fd);
+	#else
+		(void)e;
+		(void)fd;
+		return 0;
+	#endif
+}
@@ -4,9 +4,17 @@
 #include <stddef.h>
 
 #ifdef __linux__
+	#include <stdint.h>
 	#include <sys/epoll.h>
 
-	typedef struct epoll_event queue_event;
+	typedef struct {
+		uint32_t events;
+		void *data;
+		int accepted;
+		const char *received;
+		size_t len;
+		const void *recv;
+	} queue_event;
 #else
 	#include <sys/types.h>
 	#include <sys/event.h>
@@ -20,14 +28,21 @@ enum queue_event_type {
 	QUEUE_EVENT_OUT,
 };
 
-int queue_create(void);
-int queue_add_fd(int, int, enum queue_event_type, int, const void *);
-int queue_mod_fd(int, int, enum queue_event_type, const void *);
-int queue_rem_fd(int, int);
-ssize_t queue_wait(int, queue_event *, size_t);
+struct queue;
+
+struct queue *queue_create(size_t, int);
+int queue_add_fd(struct queue *, int, enum queue_event_type, int,
+                 const void *);
+int queue_mod_fd(struct queue *, int, enum queue_event_type, const void *);
+int queue_rem_fd(struct queue *, int);
+void queue_forget_fd(struct queue *, int);
+ssize_t queue_wait(struct queue *, queue_event *, size_t, int);
 
 void *queue_event_get_data(const queue_event *);
+int queue_event_get_accepted(const queue_event *);
+const char *queue_event_get_received(const queue_event *, size_t *);
 
 int queue_event_is_error(const queue_event *e);
+int queue_event_is_stale(const queue_event *e, int);
 
 #endif /* QUEUE_H */
@@ -1,43 +1,144 @@
 /* See LICENSE file for copyright and license details. */
 #include <errno.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
+#include <time.h>
 
 #include "connection.h"
+#include "cpu.h"
+#include "pool.h"
 #include "queue.h"
 #include "server.h"
 #include "util.h"
+#include "wheel.h"
 
 struct worker_data {
 	int insock;
 	size_t nslots;
+	struct connection_budget *budget;
+	struct cpuset cpus;
 	const struct server *srv;
+
+	/* how many connections the wakeups on insock yield */
+	pthread_mutex_t lock;
+	size_t nwakeups;
+	size_t naccepted;
+	size_t maxaccepted;
 };
 
+static time_t
+server_now(void)
+{
+	struct timespec ts;
+
+	/* deadlines are kept on the monotonic clock, in seconds */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+static int
+server_timeout(const struct wheel *w)
+{
+	struct timespec ts;
+	time_t next;
+
+	/* wait until the next timers are due, or forever */
+	if ((next = wheel_next(w)) < 0) {
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (next <= ts.tv_sec) {
+		return 0;
+	}
+
+	return (next - ts.tv_sec) * 1000 - ts.tv_nsec / 1000000;
+}
+
+static void
+server_count_accepts(struct worker_data *d, size_t n)
+{
+	pthread_mutex_lock(&d->lock);
+	d->nwakeups++;
+	d->naccepted += n;
+	d->maxaccepted = MAX(d->maxaccepted, n);
+	pthread_mutex_unlock(&d->lock);
+}
+
+static void
+server_report(struct worker_data *d, size_t nthreads)
+{
+	size_t i;
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_mutex_lock(&d[i].lock);
+		printf("worker %zu: %zu accepted in %zu wakeups, "
+		       "at most %zu at once\n", i, d[i].naccepted,
+		       d[i].nwakeups, d[i].maxaccepted);
+		pthread_mutex_unlock(&d[i].lock);
+	}
+	fflush(stdout);
+}
+
 static void *
 server_worker(void *data)
 {
 	queue_event *event = NULL;
-	struct connection *connection, *c, *newc;
+	struct connection_table table;
+	struct connection *c, *newc;
+	struct connection_pools pools;
 	struct worker_data *d = (struct worker_data *)data;
-	int qfd;
+	struct queue *q;
+	struct timer *t;
+	struct wheel wheel;
 	ssize_t nready;
-	size_t i;
+	size_t i, len, naccepted;
+	time_t now;
+	const char *received;
+	int fd;
 
-	/* allocate connections */
-	if (!(connection = calloc(d->nslots, sizeof(*connection)))) {
-		die("calloc:");
+	/*
+	 * move to our CPUs before allocating anything, so the memory
+	 * we touch first is placed on their NUMA node
+	 */
+	if (d->srv->pin && cpu_pin(&d->cpus)) {
+		exit(1);
+	}
+
+	/*
+	 * create the pools connections take their state from while
+	 * serving a request. Only a fraction of the slots is expected
+	 * to be busy at any time, which bounds what is kept for reuse
+	 */
+	if (!(pools.header = pool_create(BUFFER_SIZE, d->nslots / 4 + 1)) ||
+	    !(pools.body = pool_create(d->srv->bufsize, d->nslots / 8 + 1)) ||
+	    !(pools.request = pool_create(sizeof(struct request),
+	                                  d->nslots / 4 + 1)) ||
+	    !(pools.response = pool_create(sizeof(struct response),
+	                                   d->nslots / 4 + 1)) ||
+	    !(pools.peer = pool_create(sizeof(struct connection_peer),
+	                               d->nslots / 4 + 1))) {
+		exit(1);
 	}
 
 	/* create event queue */
-	if ((qfd = queue_create()) < 0) {
+	if (!(q = queue_create(d->nslots, d->srv->uring))) {
+		exit(1);
+	}
+
+	/*
+	 * allocate connections, starting out small and taking more
+	 * slots from the budget shared with the other threads as needed
+	 */
+	if (connection_table_init(&table, d->nslots, d->budget, q)) {
 		exit(1);
 	}
 
 	/* add insock to the interest list (with data=NULL) */
-	if (queue_add_fd(qfd, d->insock, QUEUE_EVENT_IN, 1, NULL) < 0) {
+	if (queue_add_fd(q, d->insock, QUEUE_EVENT_IN, 1, NULL) < 0) {
 		exit(1);
 	}
 
@@ -46,58 +147,93 @@ server_worker(void *data)
 		die("reallocarray:");
 	}
 
+	/* the deadlines of our connections */
+	wheel_init(&wheel, server_now());
+
 	for (;;) {
-		/* wait for new activity */
-		if ((nready = queue_wait(qfd, event, d->nslots)) < 0) {
+		/* wait for new activity or the next deadline */
+		if ((nready = queue_wait(q, event, d->nslots,
+		                         server_timeout(&wheel))) < 0) {
 			exit(1);
 		}
+		now = server_now();
 
 		/* handle events */
 		for (i = 0; i < (size_t)nready; i++) {
 			c = queue_event_get_data(&event[i]);
 
 			if (queue_event_is_error(&event[i])) {
-				if (c != NULL) {
-					queue_rem_fd(qfd, c->fd);
-					c->res.status = 0;
-					connection_log(c);
-					connection_reset(c);
+				if (c != NULL && c->fd >= 0) {
+					queue_rem_fd(q, c->fd);
+					connection_drop(c);
 				}
 
 				continue;
 			}
 
 			if (c == NULL) {
-				/* add new connection to the interest list */
-				if (!(newc = connection_accept(d->insock,
-				                               connection,
-				                               d->nslots))) {
+				/*
+				 * take the connection the queue has already
+				 * accepted, or accept the pending ones
+				 * ourselves, but only so many at a time to
+				 * leave some to the other workers and get
+				 * back to our connections
+				 */
+				fd = queue_event_get_accepted(&event[i]);
+				for (naccepted = 0; naccepted < ACCEPT_BUDGET;
+				     naccepted++) {
+					if (fd >= 0) {
+						newc = connection_adopt(fd,
+						        &table, &pools);
+					} else {
+						newc = connection_accept(
+						        d->insock, &table,
+						        &pools);
+					}
+					if (newc == NULL) {
+						/*
+						 * the backlog is drained or
+						 * something failed. In both
+						 * cases, we just carry on
+						 */
+						break;
+					}
+
 					/*
-					 * the socket is either blocking
-					 * or something failed.
-					 * In both cases, we just carry on
+					 * add event to the interest list
+					 * (we want IN, because we start
+					 * with receiving the header)
 					 */
-					continue;
+					if (queue_add_fd(q, newc->fd,
+					                 QUEUE_EVENT_IN,
+					                 0, newc) < 0) {
+						/* not much we can do here */
+						connection_reset(newc);
+					} else {
+						connection_arm(newc, d->srv,
+						               &wheel, now);
+					}
+					if (fd >= 0) {
+						/* the queue hands us one */
+						naccepted++;
+						break;
+					}
 				}
-
-				/*
-				 * add event to the interest list
-				 * (we want IN, because we start
-				 * with receiving the header)
-				 */
-				if (queue_add_fd(qfd, newc->fd,
-				                 QUEUE_EVENT_IN,
-						 0, newc) < 0) {
-					/* not much we can do here */
+				server_count_accepts(d, naccepted);
+			} else {
+				if (c->fd < 0 ||
+				    queue_event_is_stale(&event[i], c->fd)) {
+					/* meant for a previous connection */
 					continue;
 				}
-			} else {
+
 				/* serve existing connection */
-				connection_serve(c, d->srv);
+				received = queue_event_get_received(&event[i],
+				                                    &len);
+				connection_serve(c, d->srv, received, len);
 
-				if (c->fd == 0) {
+				if (c->fd < 0) {
 					/* we are done */
-					memset(c, 0, sizeof(struct connection));
 					continue;
 				}
 
@@ -107,7 +243,7 @@ server_worker(void *data)
 				 */
 				switch(c->state) {
 				case C_RECV_HEADER:
-					if (queue_mod_fd(qfd, c->fd,
+					if (queue_mod_fd(q, c->fd,
 					                 QUEUE_EVENT_IN,
 					                 c) < 0) {
 						connection_reset(c);
@@ -116,7 +252,7 @@ server_worker(void *data)
 					break;
 				case C_SEND_HEADER:
 				case C_SEND_BODY:
-					if (queue_mod_fd(qfd, c->fd,
+					if (queue_mod_fd(q, c->fd,
 					                 QUEUE_EVENT_OUT,
 					                 c) < 0) {
 						connection_reset(c);
@@ -126,29 +262,79 @@ server_worker(void *data)
 				default:
 					break;
 				}
+				if (c->fd >= 0) {
+					connection_arm(c, d->srv, &wheel, now);
+				}
 			}
 		}
+
+		/*
+		 * close the connections that have run out of time, after
+		 * the events, so none of them can refer to a closed one
+		 */
+		while ((t = wheel_expired(&wheel, now)) != NULL) {
+			c = t->data;
+			queue_rem_fd(q, c->fd);
+			connection_expire(c);
+		}
+
+		/* give back the slots we no longer need */
+		connection_table_shrink(&table);
 	}
 
 	return NULL;
 }
 
 void
-server_init_thread_pool(int insock, size_t nthreads, size_t nslots,
-                        const struct server *srv)
+server_init_thread_pool(const int *insock, size_t ninsock, size_t nthreads,
+                        size_t nslots, const struct server *srv)
 {
 	pthread_t *thread = NULL;
 	struct worker_data *d = NULL;
+	struct connection_budget budget;
+	struct cpuset allowed;
+	sigset_t set;
 	size_t i;
+	int sig;
 
 	/* allocate worker_data structs */
 	if (!(d = reallocarray(d, nthreads, sizeof(*d)))) {
 		die("reallocarray:");
 	}
+	/* the connection slots all threads share */
+	if (connection_budget_init(&budget, nthreads, nslots)) {
+		exit(1);
+	}
+
+	if (srv->pin && cpu_get_allowed(&allowed)) {
+		die("Can't determine the CPUs to pin the threads to");
+	}
 	for (i = 0; i < nthreads; i++) {
-		d[i].insock = insock;
+		/* the threads share a listening socket, or have their own */
+		d[i].insock = insock[i % ninsock];
 		d[i].nslots = nslots;
+		d[i].budget = &budget;
+		if (srv->pin) {
+			cpu_select(&allowed, i, nthreads, &d[i].cpus);
+		}
 		d[i].srv = srv;
+		if ((errno = pthread_mutex_init(&d[i].lock, NULL))) {
+			die("pthread_mutex_init:");
+		}
+		d[i].nwakeups = d[i].naccepted = d[i].maxaccepted = 0;
+	}
+
+	/*
+	 * the threads inherit SIGUSR1 blocked, leaving it to us to
+	 * report their accept statistics on it
+	 */
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	if ((errno = pthread_sigmask(SIG_BLOCK, &set, NULL))) {
+		die("pthread_sigmask:");
+	}
+	if (signal(SIGUSR1, SIG_DFL) == SIG_ERR) {
+		die("signal: Failed to set SIG_DFL on SIGUSR1");
 	}
 
 	/* allocate and initialize thread pool */
@@ -168,10 +354,10 @@ server_init_thread_pool(int insock, size_t nthreads, size_t nslots,
 		}
 	}
 
-	/* wait for threads */
-	for (i = 0; i < nthreads; i++) {
-		if ((errno = pthread_join(thread[i], NULL))) {
-			warn("pthread_join:");
+	/* the threads run until the process ends, report on request */
+	for (;;) {
+		if (sigwait(&set, &sig) == 0) {
+			server_report(d, nthreads);
 		}
 	}
 }
@@ -24,12 +24,20 @@ struct server {
 	char *port;
 	char *docindex;
 	int listdirs;
+	int uring;
+	int pin;
+	int compress;
+	int keepalive;
+	size_t maxrequests;
+	int h2;
+	size_t bufsize;
 	struct vhost *vhost;
 	size_t vhost_len;
 	struct map *map;
 	size_t map_len;
 };
 
-void server_init_thread_pool(int, size_t, size_t, const struct server *);
+void server_init_thread_pool(const int *, size_t, size_t, size_t,
+                             const struct server *);
 
 #endif /* SERVER_H */
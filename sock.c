@@ -14,11 +14,16 @@
 #include <sys/un.h>
 #include <unistd.h>
 
+#ifdef __linux__
+	#include <linux/filter.h>
+	#include <sys/syscall.h>
+#endif
+
 #include "sock.h"
 #include "util.h"
 
 int
-sock_get_ips(const char *host, const char* port)
+sock_get_ips(const char *host, const char* port, int reuseport)
 {
 	struct addrinfo hints = {
 		.ai_flags    = AI_NUMERICSERV,
@@ -41,6 +46,10 @@ sock_get_ips(const char *host, const char* port)
 		               &(int){1}, sizeof(int)) < 0) {
 			die("setsockopt:");
 		}
+		if (reuseport && setsockopt(insock, SOL_SOCKET, SO_REUSEPORT,
+		                            &(int){1}, sizeof(int)) < 0) {
+			die("setsockopt:");
+		}
 		if (bind(insock, p->ai_addr, p->ai_addrlen) < 0) {
 			/* bind failed, close the insock and retry */
 			if (close(insock) < 0) {
@@ -69,6 +78,38 @@ sock_get_ips(const char *host, const char* port)
 	return insock;
 }
 
+void
+sock_steer_cpu(int insock, size_t n)
+{
+	#ifdef __linux__
+		struct sock_filter code[] = {
+			/* the CPU that received the connection */
+			{ BPF_LD | BPF_W | BPF_ABS, 0, 0,
+			  SKF_AD_OFF + SKF_AD_CPU },
+			/* picks one of the n sockets, in order of binding */
+			{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, n },
+			{ BPF_RET | BPF_A, 0, 0, 0 },
+		};
+		struct sock_fprog prog = {
+			.len    = LEN(code),
+			.filter = code,
+		};
+
+		/*
+		 * hand a connection to the listening socket in the
+		 * SO_REUSEPORT group of insock that belongs to the CPU
+		 * it arrived on, instead of the one its hash picks
+		 */
+		if (setsockopt(insock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+		               &prog, sizeof(prog)) < 0) {
+			die("setsockopt:");
+		}
+	#else
+		(void)insock;
+		(void)n;
+	#endif
+}
+
 int
 sock_get_uds(const char *udsname, uid_t uid, gid_t gid)
 {
@@ -155,6 +196,36 @@ sock_set_nonblocking(int fd)
 	return 0;
 }
 
+int
+sock_accept(int insock, struct sockaddr_storage *in_sa)
+{
+	int fd;
+
+	#ifdef __linux__
+		/*
+		 * accept a connection in non-blocking and close-on-exec
+		 * mode right away, sparing us the fcntl()'s
+		 */
+		fd = syscall(__NR_accept4, insock, (struct sockaddr *)in_sa,
+		             &(socklen_t){sizeof(*in_sa)},
+		             SOCK_NONBLOCK | SOCK_CLOEXEC);
+	#else
+		if ((fd = accept(insock, (struct sockaddr *)in_sa,
+		                 &(socklen_t){sizeof(*in_sa)})) < 0) {
+			return -1;
+		}
+
+		/* we can't allow blocking sockets, nor leak them */
+		if (sock_set_nonblocking(fd) ||
+		    fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+			close(fd);
+			return -1;
+		}
+	#endif
+
+	return fd;
+}
+
 int
 sock_get_inaddr_str(const struct sockaddr_storage *in_sa, char *str,
                     size_t len)
@@ -207,3 +278,30 @@ sock_same_addr(const struct sockaddr_storage *sa1, const struct sockaddr_storage
 		              ((struct sockaddr_un *)sa2)->sun_path) == 0;
 	}
 }
+
+uint32_t
+sock_hash_addr(const struct sockaddr_storage *sa)
+{
+	const unsigned char *p;
+	size_t i, len;
+	uint32_t h = 2166136261u;
+
+	/* FNV-1a over what sock_same_addr() compares */
+	switch (sa->ss_family) {
+	case AF_INET6:
+		p = ((struct sockaddr_in6 *)sa)->sin6_addr.s6_addr;
+		len = sizeof(((struct sockaddr_in6 *)sa)->sin6_addr.s6_addr);
+		break;
+	case AF_INET:
+		p = (unsigned char *)&((struct sockaddr_in *)sa)->sin_addr.s_addr;
+		len = sizeof(((struct sockaddr_in *)sa)->sin_addr.s_addr);
+		break;
+	default: /* AF_UNIX */
+		return strhash(((struct sockaddr_un *)sa)->sun_path);
+	}
+	for (i = 0; i < len; i++) {
+		h = (h ^ p[i]) * 16777619u;
+	}
+
+	return h;
+}
@@ -3,16 +3,20 @@
 #define SOCK_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
-int sock_get_ips(const char *, const char *);
+int sock_get_ips(const char *, const char *, int);
+void sock_steer_cpu(int, size_t);
 int sock_get_uds(const char *, uid_t, gid_t);
 void sock_rem_uds(const char *);
 int sock_set_timeout(int, int);
 int sock_set_nonblocking(int);
+int sock_accept(int, struct sockaddr_storage *);
 int sock_get_inaddr_str(const struct sockaddr_storage *, char *, size_t);
 int sock_same_addr(const struct sockaddr_storage *,
                    const struct sockaddr_storage *);
+uint32_t sock_hash_addr(const struct sockaddr_storage *);
 
 #endif /* SOCK_H */
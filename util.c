@@ -13,6 +13,7 @@
 #include <unistd.h>
 #endif /* __OpenBSD__ */
 
+#include "pool.h"
 #include "util.h"
 
 char *argv0;
@@ -194,7 +195,27 @@ err:
 	return 1;
 }
 
+uint32_t
+strhash(const char *s)
+{
+	uint32_t h = 2166136261u;
+
+	/* FNV-1a */
+	for (; *s != '\0'; s++) {
+		h = (h ^ (unsigned char)*s) * 16777619u;
+	}
 
+	return h;
+}
+
+int
+same_file(const struct stat *st1, const struct stat *st2)
+{
+	return st1->st_dev == st2->st_dev && st1->st_ino == st2->st_ino &&
+	       st1->st_size == st2->st_size &&
+	       st1->st_mtim.tv_sec == st2->st_mtim.tv_sec &&
+	       st1->st_mtim.tv_nsec == st2->st_mtim.tv_nsec;
+}
 
 #define	INVALID  1
 #define	TOOSMALL 2
@@ -256,6 +277,44 @@ reallocarray(void *optr, size_t nmemb, size_t size)
 	return realloc(optr, size * nmemb);
 }
 
+int
+buffer_get(struct buffer *buf, struct pool *p)
+{
+	if (buf->pool == p) {
+		/* keep the storage we have */
+		buf->off = buf->len = 0;
+		return 0;
+	}
+	buffer_put(buf);
+	if (!(buf->data = pool_get(p))) {
+		return 1;
+	}
+	buf->size = pool_size(p);
+	buf->pool = p;
+
+	return 0;
+}
+
+void
+buffer_put(struct buffer *buf)
+{
+	if (buf->pool != NULL) {
+		pool_put(buf->pool, buf->data);
+	}
+	memset(buf, 0, sizeof(*buf));
+}
+
+void
+buffer_compact(struct buffer *buf)
+{
+	/* move the unconsumed data to the front, making room at the end */
+	if (buf->off > 0) {
+		memmove(buf->data, buf->data + buf->off, buf->len - buf->off);
+		buf->len -= buf->off;
+		buf->off = 0;
+	}
+}
+
 int
 buffer_appendf(struct buffer *buf, const char *suffixfmt, ...)
 {
@@ -264,13 +323,13 @@ buffer_appendf(struct buffer *buf, const char *suffixfmt, ...)
 
 	va_start(ap, suffixfmt);
 	ret = vsnprintf(buf->data + buf->len,
-	                sizeof(buf->data) - buf->len, suffixfmt, ap);
+	                buf->size - buf->len, suffixfmt, ap);
 	va_end(ap);
 
-	if (ret < 0 || (size_t)ret >= (sizeof(buf->data) - buf->len)) {
+	if (ret < 0 || (size_t)ret >= (buf->size - buf->len)) {
 		/* truncation occured, discard and error out */
 		memset(buf->data + buf->len, 0,
-		       sizeof(buf->data) - buf->len);
+		       buf->size - buf->len);
 		return 1;
 	}
 
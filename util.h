@@ -4,14 +4,24 @@
 
 #include <regex.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
 #include <time.h>
 
 #include "config.h"
 
-/* general purpose buffer */
+struct pool;
+
+/*
+ * general purpose buffer, its storage is taken from a pool. The data
+ * yet to be consumed lies between the cursor off and len
+ */
 struct buffer {
-	char data[BUFFER_SIZE];
+	char *data;
+	size_t size;
+	size_t off;
 	size_t len;
+	struct pool *pool;
 };
 
 #undef MIN
@@ -33,10 +43,15 @@ int timestamp(char *, size_t, time_t);
 int esnprintf(char *, size_t, const char *, ...);
 int prepend(char *, size_t, const char *);
 int spacetok(const char *, char **, size_t);
+uint32_t strhash(const char *);
+int same_file(const struct stat *, const struct stat *);
 
 void *reallocarray(void *, size_t, size_t);
 long long strtonum(const char *, long long, long long, const char **);
 
+int buffer_get(struct buffer *, struct pool *);
+void buffer_put(struct buffer *);
+void buffer_compact(struct buffer *);
 int buffer_appendf(struct buffer *, const char *, ...);
 
 #endif /* UTIL_H */
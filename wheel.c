@@ -0,0 +1,141 @@
+/* See LICENSE file for copyright and license details. */
+#include <stddef.h>
+#include <time.h>
+
+#include "util.h"
+#include "wheel.h"
+
+#define MASK (WHEEL_SIZE - 1)
+
+void
+wheel_init(struct wheel *w, time_t now)
+{
+	size_t i, j;
+
+	/* each slot is the sentinel of a circular list */
+	for (i = 0; i < WHEEL_LEVELS; i++) {
+		for (j = 0; j < WHEEL_SIZE; j++) {
+			w->slot[i][j].next = w->slot[i][j].prev = &w->slot[i][j];
+		}
+	}
+	w->tick = now;
+}
+
+static void
+link_timer(struct wheel *w, struct timer *t)
+{
+	struct timer *head;
+	time_t e = MAX(t->expires, w->tick);
+
+	if ((e >> WHEEL_BITS) == (w->tick >> WHEEL_BITS)) {
+		head = &w->slot[0][e & MASK];
+	} else if ((e >> WHEEL_BITS) - (w->tick >> WHEEL_BITS) < WHEEL_SIZE) {
+		head = &w->slot[1][(e >> WHEEL_BITS) & MASK];
+	} else {
+		/* beyond the wheel's reach, looked at again in the last run */
+		head = &w->slot[1][((w->tick >> WHEEL_BITS) - 1) & MASK];
+	}
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+static void
+unlink_timer(struct timer *t)
+{
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+}
+
+void
+wheel_add(struct wheel *w, struct timer *t, time_t expires)
+{
+	/* (re)arm the timer */
+	wheel_del(t);
+	t->expires = expires;
+	link_timer(w, t);
+}
+
+void
+wheel_del(struct timer *t)
+{
+	/* disarm the timer, if armed */
+	if (t->next != NULL) {
+		unlink_timer(t);
+	}
+}
+
+static int
+wheel_empty(const struct wheel *w)
+{
+	size_t i, j;
+
+	for (i = 0; i < WHEEL_LEVELS; i++) {
+		for (j = 0; j < WHEEL_SIZE; j++) {
+			if (w->slot[i][j].next != &w->slot[i][j]) {
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+struct timer *
+wheel_expired(struct wheel *w, time_t now)
+{
+	struct timer *head, *t, *next;
+
+	/*
+	 * hand out the timers due by now one at a time, disarmed, and
+	 * advance the wheel second by second, moving a run's timers
+	 * down to the first level as it comes up
+	 */
+	for (;;) {
+		head = &w->slot[0][w->tick & MASK];
+		if (head->next != head) {
+			t = head->next;
+			unlink_timer(t);
+			return t;
+		}
+		if (w->tick >= now) {
+			return NULL;
+		}
+		if (now - w->tick > WHEEL_SIZE && wheel_empty(w)) {
+			/* after a long sleep, there is nothing to walk past */
+			w->tick = now;
+			continue;
+		}
+		if ((++w->tick & MASK) == 0) {
+			head = &w->slot[1][(w->tick >> WHEEL_BITS) & MASK];
+			for (t = head->next; t != head; t = next) {
+				next = t->next;
+				unlink_timer(t);
+				link_timer(w, t);
+			}
+		}
+	}
+}
+
+time_t
+wheel_next(const struct wheel *w)
+{
+	time_t t;
+
+	/*
+	 * the second the next timers are due in, or the start of the
+	 * next run if there are only later ones (-1 if there are none)
+	 */
+	if (wheel_empty(w)) {
+		return -1;
+	}
+	for (t = w->tick; (t & MASK) != 0 || t == w->tick; t++) {
+		if (w->slot[0][t & MASK].next != &w->slot[0][t & MASK]) {
+			return t;
+		}
+	}
+
+	return t;
+}
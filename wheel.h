@@ -0,0 +1,36 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <time.h>
+
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 2
+
+/* a timer is embedded in what it times, data points back to it */
+struct timer {
+	struct timer *next;
+	struct timer *prev;
+	time_t expires;
+	void *data;
+};
+
+/*
+ * hierarchical timing wheel with a resolution of a second: the first
+ * level holds the timers due within the current run of WHEEL_SIZE
+ * seconds, the second those of the following runs, which are moved
+ * down as their run comes up
+ */
+struct wheel {
+	struct timer slot[WHEEL_LEVELS][WHEEL_SIZE];
+	time_t tick;
+};
+
+void wheel_init(struct wheel *, time_t);
+void wheel_add(struct wheel *, struct timer *, time_t);
+void wheel_del(struct timer *);
+struct timer *wheel_expired(struct wheel *, time_t);
+time_t wheel_next(const struct wheel *);
+
+#endif /* WHEEL_H */